@@ -4,15 +4,111 @@
 #include <assert.h>
 #include <signal.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include <vector>
 #include <algorithm>
 #include <iostream>
 #include <climits>
 #include <random>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <new>
+
+/**
+ * Max number of players, rounded up to a multiple of 64.
+ *   Override with -DMAX_PLAYER=N, smaller is faster
+ */
+#ifndef MAX_PLAYER
+#define MAX_PLAYER 256
+#endif
+
+/**
+ * Fixed size set of players, stored as 64-bit words
+ */
+template <int BITS>
+struct Bitset
+{
+  static const int WORDS = (BITS + 63) / 64;
+  uint64_t w[WORDS];
+
+  Bitset() = default;
+
+  // only for "mask = 0" and "mask == 0"
+  Bitset(int zero) {
+    assert(zero == 0);
+    for (int i = 0; i < WORDS; i++)
+      w[i] = 0;
+  }
+
+  Bitset& operator|=(const Bitset& o) {
+#if defined(__AVX2__)
+    if (WORDS % 4 == 0) {
+      for (int i = 0; i < WORDS; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(w + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(o.w + i));
+        _mm256_storeu_si256((__m256i*)(w + i), _mm256_or_si256(a, b));
+      }
+      return *this;
+    }
+#endif
+    for (int i = 0; i < WORDS; i++)
+      w[i] |= o.w[i];
+    return *this;
+  }
+
+  Bitset& operator&=(const Bitset& o) {
+#if defined(__AVX2__)
+    if (WORDS % 4 == 0) {
+      for (int i = 0; i < WORDS; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(w + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(o.w + i));
+        _mm256_storeu_si256((__m256i*)(w + i), _mm256_and_si256(a, b));
+      }
+      return *this;
+    }
+#endif
+    for (int i = 0; i < WORDS; i++)
+      w[i] &= o.w[i];
+    return *this;
+  }
+
+  Bitset& operator^=(const Bitset& o) {
+    for (int i = 0; i < WORDS; i++)
+      w[i] ^= o.w[i];
+    return *this;
+  }
 
-#define MAX_PLAYER 32
-typedef unsigned mask_t;
+  Bitset operator~() const {
+    Bitset r;
+    for (int i = 0; i < WORDS; i++)
+      r.w[i] = ~w[i];
+    return r;
+  }
+
+  Bitset operator|(const Bitset& o) const { Bitset r = *this; return r |= o; }
+  Bitset operator&(const Bitset& o) const { Bitset r = *this; return r &= o; }
+  Bitset operator^(const Bitset& o) const { Bitset r = *this; return r ^= o; }
+
+  bool operator==(const Bitset& o) const {
+    uint64_t diff = 0;
+    for (int i = 0; i < WORDS; i++)
+      diff |= w[i] ^ o.w[i];
+    return diff == 0;
+  }
+
+  bool operator!=(const Bitset& o) const { return !(*this == o); }
+};
+
+typedef Bitset<MAX_PLAYER> mask_t;
 
 volatile bool stopnow = false;
 void sigterm(int) {
@@ -21,9 +117,6 @@ void sigterm(int) {
 
 using std::vector;
 
-int max_round = 0;
-int player_count = 0;
-int games_per_player = 0;
 const int players_per_game = 7;
 const int rounds_per_team = 2;
 const char * games_filename = "matcher.csv";
@@ -32,94 +125,387 @@ const char * players_filename = "spelare.csv";
 const int cmp_min_ledare = 2;
 const int cmp_games_diff = 2;
 
+// simulated annealing, see anneal()
+bool anneal_mode = false;
+double anneal_t0 = 50;
+double anneal_alpha = 0.9999;
+double anneal_tmin = 0.5;
+int anneal_reheat = 500;
+
+// parallel tempering, see temper()
+bool tempering_mode = false;
+double tempering_tmin = 1;
+double tempering_tmax = 100;
+int tempering_interval = 1000;
+
+// tabu search, see Tabu
+bool tabu_mode = false;
+int tabu_tenure = 10;
+int tabu_candidates = 8;
+int tabu_restart = 20000;
+
+// sync threads every epoch_loops loops, see sync_epoch()
+bool deterministic_mode = false;
+int epoch_loops = 10000;
+
+// loops per search
+int search_loops = 1000000;
+
+// splits of a round to try, see polish_round(), 0 to not polish
+long polish_leaves = 20000;
+
+// weights of perm0() to perm3(), see propose_move()
+int move_mix[4] = { 2, 2, 1, 1 };
+
+// search 0 is an exact search, see Exact
+bool exact_mode = false;
+
+// rounds before this are taken from --start and never changed
+int freeze_round = 0;
+
+// search i seeds its Rand with rand_seed + i, see search_task()
+uint64_t rand_seed = 0;
+
 static inline
 bool
-test_bit(mask_t mask, int bit) {
-  return (mask & (1 << bit)) != 0;
+test_bit(const mask_t & mask, int bit) {
+  return (mask.w[bit >> 6] >> (bit & 63)) & 1;
 }
 
 static inline
 void
 set_bit(mask_t & mask, int bit) {
-  mask |= (1 << bit);
+  mask.w[bit >> 6] |= (uint64_t)1 << (bit & 63);
 }
 
 static inline
 void
 clear_bit(mask_t & mask, int bit) {
-  mask &= ~(mask_t)(1 << bit);
+  mask.w[bit >> 6] &= ~((uint64_t)1 << (bit & 63));
+}
+
+static inline
+void
+or_mask(mask_t & mask, const mask_t & mask1)
+{
+  mask |= mask1;
 }
 
+/**
+ * Lowest set bit >= bit, or -1 if there is none
+ */
+static inline
+int
+next_bit(const mask_t & mask, int bit)
+{
+  int i = bit >> 6;
+  if (i >= mask_t::WORDS)
+    return -1;
+  uint64_t word = mask.w[i] & (~(uint64_t)0 << (bit & 63));
+  while (word == 0) {
+    if (++i == mask_t::WORDS)
+      return -1;
+    word = mask.w[i];
+  }
+  return (i << 6) + __builtin_ctzll(word);
+}
+
+/**
+ * Bit kernels
+ *
+ * count_bits() and select_bit() come in a portable version and in
+ * versions using popcnt and pdep/tzcnt. If the compiler is allowed to use
+ * these instructions (e.g -march=native) they are called directly,
+ * otherwise init_bit_kernels() picks one at startup depending on
+ * what the cpu supports.
+ */
 static inline
 int
-count_bits(mask_t mask) {
+popcount_portable(uint64_t x)
+{
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+static
+int
+count_bits_portable(const mask_t & mask) {
   int count = 0;
-  while (mask) {
-    if (mask & 1)
-      count++;
-    mask >>= 1;
+  for (int i = 0; i < mask_t::WORDS; i++)
+    count += popcount_portable(mask.w[i]);
+  return count;
+}
+
+// The no:th (starting from 0) set bit in mask
+static
+int
+select_bit_portable(const mask_t & mask, int no)
+{
+  for (int i = 0; i < mask_t::WORDS; i++) {
+    uint64_t word = mask.w[i];
+    int cnt = popcount_portable(word);
+    if (no < cnt) {
+      for (; no > 0; no--)
+        word &= word - 1; // clear lowest set bit
+      return (i << 6) + __builtin_ctzll(word);
+    }
+    no -= cnt;
   }
+  assert(false);
+  return -1;
+}
+
+#if defined(__x86_64__)
+#define HAVE_BIT_KERNELS_X86 1
+
+__attribute__((target("popcnt")))
+static
+int
+count_bits_popcnt(const mask_t & mask) {
+  int count = 0;
+  for (int i = 0; i < mask_t::WORDS; i++)
+    count += __builtin_popcountll(mask.w[i]);
   return count;
 }
 
-static inline
+__attribute__((target("popcnt,bmi,bmi2")))
+static
+int
+select_bit_bmi2(const mask_t & mask, int no)
+{
+  for (int i = 0; i < mask_t::WORDS; i++) {
+    uint64_t word = mask.w[i];
+    int cnt = __builtin_popcountll(word);
+    if (no < cnt) {
+      // deposit bit no at the no:th set bit of word
+      return (i << 6) + _tzcnt_u64(_pdep_u64((uint64_t)1 << no, word));
+    }
+    no -= cnt;
+  }
+  assert(false);
+  return -1;
+}
+#endif
+
+int (*count_bits_fn)(const mask_t &) = count_bits_portable;
+int (*select_bit_fn)(const mask_t &, int) = select_bit_portable;
+
 void
-or_mask(mask_t & mask, const mask_t & mask1)
+init_bit_kernels()
 {
-  mask |= mask1;
+#if HAVE_BIT_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("popcnt"))
+    count_bits_fn = count_bits_popcnt;
+  if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi2"))
+    select_bit_fn = select_bit_bmi2;
+#endif
+}
+
+static inline
+int
+count_bits(const mask_t & mask) {
+#if defined(__POPCNT__) && HAVE_BIT_KERNELS_X86
+  return count_bits_popcnt(mask);
+#else
+  return count_bits_fn(mask);
+#endif
+}
+
+static inline
+int
+select_bit(const mask_t & mask, int no)
+{
+#if defined(__BMI2__) && defined(__POPCNT__) && HAVE_BIT_KERNELS_X86
+  return select_bit_bmi2(mask, no);
+#else
+  return select_bit_fn(mask, no);
+#endif
 }
 
+/**
+ * xoshiro256** pseudo random generator
+ */
+struct Rand
+{
+  uint64_t s[4];
+
+  Rand() { seed(time(0) ^ (uint64_t)(uintptr_t)this); }
+
+  void seed(uint64_t seed) {
+    // splitmix64 to spread seed over the state
+    for (int i = 0; i < 4; i++) {
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      s[i] = z ^ (z >> 31);
+    }
+  }
+
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  // UniformRandomBitGenerator, for the <random> distributions
+  typedef uint64_t result_type;
+  static constexpr uint64_t min() { return 0; }
+  static constexpr uint64_t max() { return UINT64_MAX; }
+  uint64_t operator()() { return next(); }
+
+  uint64_t next() {
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+  // uniform in [0, n) without modulo bias (Lemire's method)
+  uint32_t below(uint32_t n) {
+    uint64_t m = (next() >> 32) * n;
+    uint32_t low = (uint32_t)m;
+    if (low < n) {
+      uint32_t threshold = -n % n;
+      while (low < threshold) {
+        m = (next() >> 32) * n;
+        low = (uint32_t)m;
+      }
+    }
+    return m >> 32;
+  }
+
+  // uniform in [0, 1)
+  double unit() {
+    return (next() >> 11) * (1.0 / (1ULL << 53));
+  }
+};
+
+/**
+ * The generator of this thread, every random choice is made from it so that
+ *   a run with the same seed and a single thread is reproducible
+ */
+thread_local Rand thread_rand;
+
 static inline
 unsigned
-rand_bit(mask_t mask)
+rand_bit(const mask_t & mask)
 {
-  unsigned cnt = 0;
-  unsigned list[MAX_PLAYER] = { 0 };
-  for (unsigned i = 0; i < MAX_PLAYER; i++)
-    if (test_bit(mask, i))
-      list[cnt++] = i;
+  int cnt = count_bits(mask);
   assert(cnt > 0);
-  return list[rand() % cnt];
+  return select_bit(mask, thread_rand.below(cnt));
 }
 
-struct Matrix
+/**
+ * Array stored inside the Sched block (see create_empty_sched()),
+ *   addressed relative to itself so that a Sched can be cloned with memcpy
+ */
+template <typename T>
+struct Array
 {
+  ptrdiff_t off;
   size_t n;
-  int *m;
 
-  Matrix() {
-    n = 0;
-    m = NULL;
+  void bind(T * data, size_t n) {
+    this->off = (char*)data - (char*)this;
+    this->n = n;
   }
 
-  void init(size_t n) {
-    if (n) {
-      delete [] m;
-    }
+  T * data() { return (T*)((char*)this + off); }
+  const T * data() const { return (const T*)((const char*)this + off); }
+  size_t size() const { return n; }
+  T& operator[](size_t i) { return data()[i]; }
+  const T& operator[](size_t i) const { return data()[i]; }
+  T * begin() { return data(); }
+  T * end() { return data() + n; }
+  const T * begin() const { return data(); }
+  const T * end() const { return data() + n; }
+};
+
+/**
+ * Packed upper triangle of a symmetric n x n matrix without diagonal,
+ *   stored inside the Sched block
+ */
+struct PairMatrix
+{
+  ptrdiff_t off;
+  size_t n;
+
+  static size_t cells(size_t n) { return n * (n - 1) / 2; }
+
+  void bind(unsigned short * data, size_t n) {
+    this->off = (char*)data - (char*)this;
     this->n = n;
-    this->m = new int[n*n];
-    bzero(this->m, n*n*sizeof(int));
   }
 
-  ~Matrix () {
-    if (n) {
-      delete []m;
-    }
+  unsigned short * data() { return (unsigned short*)((char*)this + off); }
+  const unsigned short * data() const {
+    return (const unsigned short*)((const char*)this + off);
   }
 
-  void copyFrom(const Matrix& m) {
-    if (n != m.n) {
-      init(m.n);
-    }
-    memcpy(this->m, m.m, n*n*sizeof(this->m[0]));
+  size_t pos(size_t i, size_t j) const {
+    assert(i != j);
+    if (i > j)
+      std::swap(i, j);
+    return (i * (2 * n - i - 1)) / 2 + (j - i - 1);
+  }
+
+  unsigned short& at(int i, int j) {
+    return data()[pos(i, j)];
+  }
+
+  const unsigned short& at(int i, int j) const {
+    return data()[pos(i, j)];
+  }
+};
+
+/**
+ * Order statistics over game scores
+ *
+ * Fenwick tree of "number of games with score X", X in [lo, hi],
+ * so that min/median/max score can be found in O(log(hi - lo))
+ * without sorting all games.
+ */
+struct ScoreTree
+{
+  int lo;
+  int size;
+  int top; // highest power of 2 <= size
+  Array<int> tree;
+
+  static size_t cells(int lo, int hi) { return hi - lo + 2; }
+
+  void init(int lo, int hi, int * data) {
+    this->lo = lo;
+    size = hi - lo + 1;
+    top = 1;
+    while (2 * top <= size)
+      top *= 2;
+    tree.bind(data, cells(lo, hi));
+    memset(data, 0, cells(lo, hi) * sizeof(int));
   }
 
-  int& at(int i, int j) {
-    return m[(i * n) + j];
+  void add(int score, int delta) {
+    assert(score >= lo && score < lo + size);
+    for (int i = score - lo + 1; i <= size; i += i & -i)
+      tree[i] += delta;
   }
 
-  const int& at(int i, int j) const {
-    return m[(i * n) + j];
+  // k:th smallest score, k starts from 0
+  int kth(int k) const {
+    int pos = 0;
+    for (int step = top; step; step >>= 1) {
+      if (pos + step <= size && tree[pos + step] <= k) {
+        pos += step;
+        k -= tree[pos];
+      }
+    }
+    return lo + pos;
   }
 };
 
@@ -136,12 +522,158 @@ struct Player
   int rand_no;
 };
 
-vector<Player*> players;
+struct Game;
+struct Sched;
+struct Global;
+struct Exchange;
+struct EpochSlot;
+
+/**
+ * The summary of a Sched that compare() looks at
+ */
+struct Stats
+{
+  /**
+   * Below is maintained incrementally by
+   * add_player_to_game()/remove_player_from_game()
+   */
+  long long sum_score;
+  long long sum_score2;
+
+  int min_games; // min games of a player
+  int max_games;
+  int min_ledare;
+  int cnt_goalkeeper;
+
+  /**
+   * Below is computed by compute_stats()
+   */
+  int cnt_never_together; // Sched::cnt_games_together[0]
+  int min_score;
+  int median_score;
+  int max_score;
+  int std_score;
+
+  int swaps;
+  int exchanges; // made by perm2()
+  int shifts;    // made by perm3()
+  int failed[4];  // calls of perm0() to perm3() that found no move
+};
+
+/**
+ * One team to schedule: what was read from its files, and the shared
+ * state of the searches for it. A run has one, a --batch run one per
+ * manifest entry. Code reaches the current one through team, which
+ * search_task() sets for each search.
+ */
+struct Team
+{
+  const char * games_filename;
+  const char * players_filename;
+  const char * output_filename; // NULL for stdout
+  const char * start_filename;  // schedule to start from, or NULL
+
+  int max_round;
+  int player_count;
+  int games_per_player;
+  vector<Player*> players;
+  int min_player_score; // lowest game score possible
+  int max_player_score; // highest game score possible
+  vector<Game*> file_games;
+  vector<uint64_t> zobrist;     // [game index * players + player index]
+  vector<int> player_class;     // [player index], see find_symmetries()
+  vector<int> game_class;       // [game index]
+  Stats bounds;                 // see compute_bounds()
+  Sched * empty_sched;
+  Sched * start;                // read from start_filename
+  int free_round;               // rounds before are frozen, see --freeze
+  vector<int> free_games;       // index of games in rounds >= free_round
+  std::atomic<bool> done;       // target or time budget reached
+  std::atomic<bool> written;    // see write_best()
+
+  Global * global;
+  int tempering_replicas; // number of searches
+  Exchange * exchanges;    // [tempering_replicas], 64 byte aligned
+  vector<EpochSlot> epoch_slots;
+  pthread_barrier_t epoch_barrier;
+  int epoch_count;
+  bool epoch_stop;
+};
+
+thread_local Team * team = NULL;
+
+/**
+ * True when the searches of the current team should stop
+ */
+static inline bool
+stopping()
+{
+  return stopnow || team->done;
+}
+
+typedef unsigned short player_no_t;
+
+/**
+ * Players in a game, as Player::index in slots inside the Sched block
+ */
+struct PlayerList
+{
+  ptrdiff_t off;
+  unsigned short n;
+  unsigned short cap;
+
+  struct iterator
+  {
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Player * value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Player ** pointer;
+    typedef Player *& reference;
+
+    const player_no_t * p;
+    Player * operator*() const { return team->players[*p]; }
+    iterator& operator++() { p++; return *this; }
+    bool operator==(const iterator& o) const { return p == o.p; }
+    bool operator!=(const iterator& o) const { return p != o.p; }
+  };
+
+  void bind(player_no_t * data, size_t cap) {
+    this->off = (char*)data - (char*)this;
+    this->n = 0;
+    this->cap = cap;
+  }
+
+  player_no_t * data() { return (player_no_t*)((char*)this + off); }
+  const player_no_t * data() const {
+    return (const player_no_t*)((const char*)this + off);
+  }
+
+  size_t size() const { return n; }
+  Player * operator[](size_t i) const { return team->players[data()[i]]; }
+  iterator begin() const { iterator it = { data() }; return it; }
+  iterator end() const { iterator it = { data() + n }; return it; }
+
+  void push_back(Player * p) {
+    assert(n < cap);
+    data()[n++] = p->index;
+  }
+
+  void erase(Player * p) {
+    player_no_t * list = data();
+    unsigned i = 0;
+    while (list[i] != p->index)
+      i++;
+    assert(i < n);
+    memmove(list + i, list + i + 1, (n - i - 1) * sizeof(list[0]));
+    n--;
+  }
+};
 
 struct Game
 {
   int round;
-  struct Sched * sched;
+  int index; // position in Sched::games
+  ptrdiff_t sched_off;
   const char * time;
   const char * desc;
 
@@ -149,67 +681,164 @@ struct Game
   int ledare;
   int goalkeeper;
   int count_players;
-  vector<Player*> players;
+  PlayerList players;
   mask_t players_mask;
   mask_t unavailable_mask;
 
+  struct Sched * sched() { return (struct Sched*)((char*)this - sched_off); }
+  const struct Sched * sched() const {
+    return (const struct Sched*)((const char*)this - sched_off);
+  }
+
   int get_score() const {
-    return score / count_players;
+    return count_players ? score / count_players : 0;
   }
 
   int count_available() const;
 };
 
-vector<Game*> file_games;
-
-struct Stats
+/**
+ * A journal entry, add or remove of player p to/from game g
+ */
+struct Move
 {
-  Stats() { swaps = 0; memset(failed_swap, 0, sizeof(failed_swap)); }
-  ~Stats() {}
-
-  vector<int> games_per_player;
-  Matrix games_together;
-
-  vector<int> min_together;
-  vector<int> cnt_games_together; // [N] == #players that has N games together
-
-  int min_games; // min games of a player
-  int max_games;
-
-  int cnt_goalkeeper;
-  int min_score;
-  int median_score;
-  int max_score;
-  int std_score;
-  int min_ledare;
+  Game * g;
+  Player * p;
+  bool add;
+};
 
-  int swaps;
-  int failed_swap[5];
+/**
+ * Games of a Sched, iterates as Game*
+ */
+struct Games : Array<Game>
+{
+  struct iterator
+  {
+    typedef std::forward_iterator_tag iterator_category;
+    typedef Game * value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Game ** pointer;
+    typedef Game *& reference;
+
+    Game * g;
+    Game * operator*() const { return g; }
+    iterator& operator++() { g++; return *this; }
+    bool operator==(const iterator& o) const { return g == o.g; }
+    bool operator!=(const iterator& o) const { return g != o.g; }
+  };
+
+  Game * operator[](size_t i) const { return (Game*)data() + i; }
+  iterator begin() const { iterator it = { (Game*)data() }; return it; }
+  iterator end() const { iterator it = { (Game*)data() + n }; return it; }
 };
 
+/**
+ * A schedule is a single block of memory, the header below
+ *   followed by the arrays that it refers to (see create_empty_sched()).
+ *
+ * Copy with copy_sched() and release with free_sched().
+ */
 struct Sched
 {
-  Sched() {}
-  ~Sched() { for (Game * g : games) { delete g; }}
+  size_t size; // of the block
+
+  // if set, add_player_to_game()/remove_player_from_game() are recorded here
+  vector<Move> * journal;
 
   int count_players;
-  vector<mask_t> players_mask_per_round;
-  vector<vector<Game*> > games_per_round;
-  vector<Game*> games;
   Stats stats;
+
+  // version of the global Best this is a copy of, see Global::fetch(),
+  // 0 once add_player_to_game()/remove_player_from_game() change it
+  uint64_t version;
+
+  /**
+   * Zobrist hash, xor of zobrist[g, p] for each player p in game g,
+   *   maintained by add_player_to_game()/remove_player_from_game(),
+   *   the key of the transposition table (see Global::seen())
+   */
+  uint64_t hash;
+  const uint64_t * zobrist; // Team::zobrist
+
+  Games games;
+  Array<mask_t> players_mask_per_round;
+  // [round * players + player], 1 + index of the game the player plays
+  // in that round, 0 if none
+  Array<unsigned short> round_game;
+  Array<int> games_per_player;
+  PairMatrix games_together;
+
+  /**
+   * Below is maintained incrementally by
+   * add_player_to_game()/remove_player_from_game()
+   */
+  Array<int> cnt_games_together; // [N] == #pairs that has N games together
+  Array<int> cnt_games;  // [N] == #players that has N games
+  Array<int> cnt_ledare; // [N] == #games that has N ledare
+  ScoreTree scores;      // game scores
 };
 
 int
 Game::count_available() const
 {
+  const Sched * s = sched();
   mask_t mask = 0;
   or_mask(mask, players_mask);
   or_mask(mask, unavailable_mask);
-  or_mask(mask, sched->players_mask_per_round[round]);
-  return sched->count_players - count_bits(mask);
+  or_mask(mask, s->players_mask_per_round[round]);
+  return s->count_players - count_bits(mask);
+}
+
+/**
+ * Unused Sched blocks of this thread, to avoid malloc/free,
+ *   one list per block size as teams differ in size
+ */
+struct SchedPool
+{
+  vector<std::pair<size_t, vector<Sched*> > > lists;
+
+  vector<Sched*> & list(size_t size) {
+    for (auto & l : lists)
+      if (l.first == size)
+        return l.second;
+    lists.push_back(std::make_pair(size, vector<Sched*>()));
+    return lists.back().second;
+  }
+
+  ~SchedPool() {
+    for (auto & l : lists)
+      for (Sched * s : l.second)
+        free(s);
+  }
+};
+
+thread_local SchedPool sched_pool;
+
+Sched*
+alloc_sched()
+{
+  size_t size = team->empty_sched->size;
+  vector<Sched*> & list = sched_pool.list(size);
+  if (!list.empty()) {
+    Sched * s = list.back();
+    list.pop_back();
+    return s;
+  }
+
+  void * ptr = NULL;
+  if (posix_memalign(&ptr, 64, size) != 0) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return (Sched*)ptr;
 }
 
-Sched empty_sched;
+void
+free_sched(Sched * s)
+{
+  if (s)
+    sched_pool.list(s->size).push_back(s);
+}
 
 bool
 sort_by_score(const Player * p1, const Player * p2)
@@ -270,7 +899,7 @@ int games_in_round(const vector<Game *> & games, int round) {
 }
 
 void copy_games_in_round(vector<Game*> & dst,
-                         const vector<Game *> & games, int round) {
+                         const Games & games, int round) {
   for (Game * g : games) {
     if (g->round == round) {
       dst.push_back(g);
@@ -290,6 +919,7 @@ void remove_round(vector<Game *> & games, int round) {
 void
 read_players(const char * filename)
 {
+  vector<Player*> & players = team->players;
   char * buf = NULL;
   size_t sz = 0;
   FILE * f = fopen(filename, "r");
@@ -347,7 +977,7 @@ read_players(const char * filename)
     //TODO handle count_as < 0
     if (p->count_as > 0)
     {
-      player_count += p->count_as;
+      team->player_count += p->count_as;
     }
     players.push_back(p);
 
@@ -365,6 +995,12 @@ read_players(const char * filename)
 
   free(buf);
 
+  if (players.size() > MAX_PLAYER) {
+    fprintf(stderr, "Too many players: %u, max is %u (see MAX_PLAYER)\n",
+            (unsigned)players.size(), (unsigned)MAX_PLAYER);
+    exit(1);
+  }
+
   std::sort(players.begin(), players.end(), sort_by_score);
 
   size_t pn = 0;
@@ -372,13 +1008,18 @@ read_players(const char * filename)
     p->index = pn;
     pn++;
 
+    if (p->score < team->min_player_score)
+      team->min_player_score = p->score;
+    if (p->score > team->max_player_score)
+      team->max_player_score = p->score;
+
     for (int m : p->mask) {
-      set_bit(file_games[m]->unavailable_mask, p->index);
+      set_bit(team->file_games[m]->unavailable_mask, p->index);
     }
   }
 
-  size_t total = file_games.size() * players_per_game;
-  games_per_player = total / player_count;
+  size_t total = team->file_games.size() * players_per_game;
+  team->games_per_player = total / team->player_count;
 }
 
 void
@@ -402,83 +1043,203 @@ read_games(const char * filename)
     d++;
 
     Game * g = new Game;
-    g->sched = NULL;
     g->round = atoi(buf);
     g->time = strdup(t);
     g->desc = strdup(d);
     g->players_mask = 0;
     g->unavailable_mask = 0;
     g->count_players = 0;
-    file_games.push_back(g);
+    team->file_games.push_back(g);
   }
 
   free(buf);
 
   int min_round = INT_MAX;
-  for (Game * g : file_games) {
+  for (Game * g : team->file_games) {
     if (g->round < min_round)
       min_round = g->round;
-    if (g->round > max_round)
-      max_round = g->round;
+    if (g->round > team->max_round)
+      team->max_round = g->round;
   }
 
-  for (Game * g : file_games) {
+  for (Game * g : team->file_games) {
     g->round -= min_round;
   }
-  max_round -= min_round;
+  team->max_round -= min_round;
 }
 
-void
-create_empty_sched()
+static inline
+size_t
+align_size(size_t size)
 {
-  for (Game * g : file_games) {
-    empty_sched.games.push_back(g);
-  }
+  return (size + 63) & ~(size_t)63;
+}
 
-  for (Game * g : file_games) {
-    while (empty_sched.players_mask_per_round.size() <= (unsigned)g->round) {
-      empty_sched.players_mask_per_round.push_back(0);
-      vector<Game*> tmp;
-      empty_sched.games_per_round.push_back(tmp);
-    }
+/**
+ * Create empty_sched, which all other schedules are copied from.
+ *
+ * The Sched is a single block laid out as
+ *   Sched | games | player slots per game | players_mask_per_round |
+ *   games_per_player | games_together | histograms | score tree
+ * with sizes given by the loaded players and games.
+ */
+void
+create_empty_sched()
+{
+  const vector<Player*> & players = team->players;
+  size_t cnt_games = team->file_games.size();
+  size_t cnt_rounds = team->max_round + 1;
+  size_t cnt = players.size();
+  int lo = std::min(team->min_player_score, 0);
+  int hi = std::max(team->max_player_score, 0);
+
+  size_t size = align_size(sizeof(Sched));
+  size_t games_off = size;
+  size += align_size(cnt_games * sizeof(Game));
+  size_t slots_off = size;
+  size += align_size(cnt_games * cnt * sizeof(player_no_t));
+  size_t masks_off = size;
+  size += align_size(cnt_rounds * sizeof(mask_t));
+  size_t round_game_off = size;
+  size += align_size(cnt_rounds * cnt * sizeof(unsigned short));
+  size_t games_per_player_off = size;
+  size += align_size(cnt * sizeof(int));
+  size_t together_off = size;
+  size += align_size(PairMatrix::cells(cnt) * sizeof(unsigned short));
+  size_t cnt_together_off = size;
+  size += align_size((cnt_games + 1) * sizeof(int));
+  size_t cnt_games_off = size;
+  size += align_size((cnt_games + 1) * sizeof(int));
+  size_t cnt_ledare_off = size;
+  size += align_size((cnt + 1) * sizeof(int));
+  size_t scores_off = size;
+  size += align_size(ScoreTree::cells(lo, hi) * sizeof(int));
+
+  void * ptr = NULL;
+  if (posix_memalign(&ptr, 64, size) != 0) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
   }
-
-  empty_sched.count_players = 0;
+  memset(ptr, 0, size);
+  char * base = (char*)ptr;
+  Sched * s = (Sched*)ptr;
+  s->size = size;
+  s->journal = NULL;
+
+  // same keys for every seed, so that a hash means the same in every run
+  Rand keys;
+  keys.seed(0x5eed);
+  team->zobrist.resize(cnt_games * cnt);
+  for (uint64_t & key : team->zobrist)
+    key = keys();
+  s->version = 0;
+  s->hash = 0;
+  s->zobrist = team->zobrist.data();
+
+  s->count_players = 0;
   for (size_t p = 0; p < players.size(); p++)
   {
-    empty_sched.stats.games_per_player.push_back(0);
-    empty_sched.count_players += abs(players[p]->count_as);
+    s->count_players += abs(players[p]->count_as);
+  }
+
+  s->games.bind((Game*)(base + games_off), cnt_games);
+  for (size_t i = 0; i < cnt_games; i++) {
+    const Game * g = team->file_games[i];
+    Game * ng = s->games[i];
+    ng->round = g->round;
+    ng->index = i;
+    ng->sched_off = (char*)ng - base;
+    ng->time = g->time;
+    ng->desc = g->desc;
+    ng->score = 0;
+    ng->ledare = 0;
+    ng->goalkeeper = 0;
+    ng->count_players = 0;
+    ng->players.bind((player_no_t*)(base + slots_off) + i * cnt, cnt);
+    ng->players_mask = 0;
+    ng->unavailable_mask = g->unavailable_mask;
   }
 
-  empty_sched.stats.games_together.init(players.size());
+  s->players_mask_per_round.bind((mask_t*)(base + masks_off), cnt_rounds);
+  s->round_game.bind((unsigned short*)(base + round_game_off),
+                     cnt_rounds * cnt);
+  s->games_per_player.bind((int*)(base + games_per_player_off), cnt);
+  s->games_together.bind((unsigned short*)(base + together_off), cnt);
+
+  s->cnt_games_together.bind((int*)(base + cnt_together_off), cnt_games + 1);
+  s->cnt_games_together[0] = PairMatrix::cells(cnt);
+  s->cnt_games.bind((int*)(base + cnt_games_off), cnt_games + 1);
+  s->cnt_games[0] = cnt;
+  s->cnt_ledare.bind((int*)(base + cnt_ledare_off), cnt + 1);
+  s->cnt_ledare[0] = cnt_games;
+  s->scores.init(lo, hi, (int*)(base + scores_off));
+  s->scores.add(0, cnt_games);
+
+  team->empty_sched = s;
 }
 
-Game*
-copy_game(const Game * g)
-{
-  Game * ng = new Game;
-  ng->sched = NULL;
-  ng->ledare = 0;
-  ng->score = 0;
-  ng->desc = g->desc;
-  ng->time = g->time;
-  ng->round = g->round;
-  ng->players_mask = 0;
-  ng->unavailable_mask = g->unavailable_mask;
-  ng->goalkeeper = 0;
-  ng->count_players = 0;
-  return ng;
+/**
+ * Move one entry in histogram cnt from bucket "from" to bucket "to"
+ *   (that differ by one) and keep track of lowest/highest non-empty bucket
+ */
+static inline
+void
+move_count(Array<int> & cnt, int from, int to, int & min, int & max)
+{
+  assert(to == from + 1 || to == from - 1);
+  cnt[from]--;
+  cnt[to]++;
+  if (to < min)
+    min = to;
+  if (to > max)
+    max = to;
+  if (cnt[from] == 0) {
+    if (from == min)
+      min = to;
+    if (from == max)
+      max = to;
+  }
+}
+
+/**
+ * Update stats after score/ledare/goalkeeper of game g has changed
+ */
+static
+void
+update_game_stats(Sched * s, const Game * g,
+                  int old_score, int old_ledare, int old_goalkeeper)
+{
+  Stats & st = s->stats;
+  int score = g->get_score();
+  if (score != old_score) {
+    s->scores.add(old_score, -1);
+    s->scores.add(score, 1);
+    st.sum_score += score - old_score;
+    st.sum_score2 += (long long)score * score -
+      (long long)old_score * old_score;
+  }
+
+  if (g->ledare != old_ledare) {
+    int max_ledare = INT_MAX;
+    move_count(s->cnt_ledare, old_ledare, g->ledare,
+               st.min_ledare, max_ledare);
+  }
+
+  st.cnt_goalkeeper += (g->goalkeeper > 0) - (old_goalkeeper > 0);
 }
 
 void
 add_player_to_game(Game * g, Player * p)
 {
-  Sched * s = g->sched;
+  Sched * s = g->sched();
+  Stats & st = s->stats;
+  int old_score = g->get_score();
+  int old_ledare = g->ledare;
+  int old_goalkeeper = g->goalkeeper;
   g->score += p->score;
   g->ledare += !!p->ledare;
   g->goalkeeper += p->goalkeeper;
   g->count_players += abs(p->count_as);
-  g->players.push_back(p);
   if (test_bit(g->players_mask, p->index)) {
     printf("assert g->players_mask %s to %s\n", p->name, g->desc);
   }
@@ -488,125 +1249,285 @@ add_player_to_game(Game * g, Player * p)
   }
   assert(!test_bit(g->unavailable_mask, p->index));
   set_bit(g->players_mask, p->index);
+  s->version = 0;
+  s->hash ^= s->zobrist[g->index * s->games_per_player.size() + p->index];
 
   assert(!test_bit(s->players_mask_per_round[g->round], p->index));
   set_bit(s->players_mask_per_round[g->round], p->index);
-  s->stats.games_per_player[p->index]++;
+  s->round_game[g->round * s->games_per_player.size() + p->index] =
+    g->index + 1;
+  if (s->journal) {
+    Move m = { g, p, true };
+    s->journal->push_back(m);
+  }
+  int games = s->games_per_player[p->index]++;
+  move_count(s->cnt_games, games, games + 1, st.min_games, st.max_games);
 
   for (Player * pp : g->players) {
-    s->stats.games_together.at(pp->index, p->index)++;
-    s->stats.games_together.at(p->index, pp->index)++;
+    int together = s->games_together.at(pp->index, p->index)++;
+    s->cnt_games_together[together]--;
+    s->cnt_games_together[together + 1]++;
   }
+  g->players.push_back(p);
+
+  update_game_stats(s, g, old_score, old_ledare, old_goalkeeper);
 }
 
 void
 remove_player_from_game(Game * g, Player * p)
 {
-  Sched * s = g->sched;
+  Sched * s = g->sched();
+  Stats & st = s->stats;
+  int old_score = g->get_score();
+  int old_ledare = g->ledare;
+  int old_goalkeeper = g->goalkeeper;
   g->score -= p->score;
   g->ledare -= !!p->ledare;
   g->goalkeeper -= p->goalkeeper;
   g->count_players -= abs(p->count_as);
-  g->players.erase(find(g->players.begin(), g->players.end(), p));
+  g->players.erase(p);
   assert(test_bit(g->players_mask, p->index));
   assert(!test_bit(g->unavailable_mask, p->index));
   clear_bit(g->players_mask, p->index);
+  s->version = 0;
+  s->hash ^= s->zobrist[g->index * s->games_per_player.size() + p->index];
 
   assert(test_bit(s->players_mask_per_round[g->round], p->index));
   clear_bit(s->players_mask_per_round[g->round], p->index);
-  s->stats.games_per_player[p->index]--;
+  s->round_game[g->round * s->games_per_player.size() + p->index] = 0;
+  if (s->journal) {
+    Move m = { g, p, false };
+    s->journal->push_back(m);
+  }
+  int games = s->games_per_player[p->index]--;
+  move_count(s->cnt_games, games, games - 1, st.min_games, st.max_games);
 
   for (Player * pp : g->players) {
-    s->stats.games_together.at(pp->index, p->index)--;
-    s->stats.games_together.at(p->index, pp->index)--;
+    int together = s->games_together.at(pp->index, p->index)--;
+    s->cnt_games_together[together]--;
+    s->cnt_games_together[together - 1]++;
   }
+
+  update_game_stats(s, g, old_score, old_ledare, old_goalkeeper);
 }
 
-Sched*
-copy_sched(const Sched * s)
+/**
+ * Roll back the moves in journal, newest first
+ */
+void
+undo_moves(Sched * s, const vector<Move> & journal)
 {
-  Sched * ns = new Sched;
-  ns->count_players = s->count_players;
-  ns->stats.games_together.init(players.size());
-  for (size_t n = 0; n < players.size(); n++) {
-    ns->stats.games_per_player.push_back(0);
-  }
-  for (size_t n = 0; n < s->players_mask_per_round.size(); n++) {
-    ns->players_mask_per_round.push_back(0);
-    vector<Game*> tmp;
-    ns->games_per_round.push_back(tmp);
+  vector<Move> * save = s->journal;
+  s->journal = NULL;
+  for (size_t i = journal.size(); i > 0; i--) {
+    const Move & m = journal[i - 1];
+    if (m.add)
+      remove_player_from_game(m.g, m.p);
+    else
+      add_player_to_game(m.g, m.p);
   }
-  for (Game * g : s->games) {
-    Game * ng = copy_game(g);
-    ng->sched = ns;
-    ns->games_per_round[ng->round].push_back(ng);
-    ns->games.push_back(ng);
+  s->journal = save;
+}
 
-    for (Player * p : g->players) {
-      add_player_to_game(ng, p);
-    }
+/**
+ * Do the moves in journal again, oldest first
+ */
+void
+redo_moves(Sched * s, const vector<Move> & journal)
+{
+  vector<Move> * save = s->journal;
+  s->journal = NULL;
+  for (const Move & m : journal) {
+    if (m.add)
+      add_player_to_game(m.g, m.p);
+    else
+      remove_player_from_game(m.g, m.p);
   }
+  s->journal = save;
+}
 
+Sched*
+copy_sched(const Sched * s)
+{
+  Sched * ns = alloc_sched();
+  memcpy(ns, s, s->size);
+  ns->journal = NULL;
   return ns;
 }
 
-void
-compute_stats(Sched * s) {
+#define VERIFY_STATS 0
 
-  {
-    s->stats.cnt_games_together.clear();
-    for (size_t n = 0; n < s->games.size(); n++)
-      s->stats.cnt_games_together.push_back(0);
-
-    s->stats.min_games = INT_MAX;
-    s->stats.max_games = 0;
-    for (size_t n = 0; n < players.size(); n++) {
-      int min_together = INT_MAX;
-      for (size_t m = n + 1; m < players.size(); m++) {
-	int val = s->stats.games_together.at(n,m);
-        s->stats.cnt_games_together[val]++;
-	if (val < min_together) {
-	  min_together = val;
-	}
-	s->stats.min_together.push_back(min_together);
-      }
+/**
+ * Recompute stats from scratch and check them against
+ * the incrementally maintained ones
+ */
+void
+verify_stats(const Sched * s) {
+  const vector<Player*> & players = team->players;
+  const Stats & st = s->stats;
+  vector<int> cnt_games_together(s->games.size() + 1, 0);
+  int min_games = INT_MAX;
+  int max_games = 0;
+  for (size_t n = 0; n < players.size(); n++) {
+    for (size_t m = n + 1; m < players.size(); m++) {
+      cnt_games_together[s->games_together.at(n,m)]++;
+    }
 
-      if (s->stats.games_per_player[players[n]->index] < s->stats.min_games)
-        s->stats.min_games = s->stats.games_per_player[players[n]->index];
+    if (s->games_per_player[players[n]->index] < min_games)
+      min_games = s->games_per_player[players[n]->index];
 
-      if (s->stats.games_per_player[players[n]->index] > s->stats.max_games)
-        s->stats.max_games = s->stats.games_per_player[players[n]->index];
-    }
+    if (s->games_per_player[players[n]->index] > max_games)
+      max_games = s->games_per_player[players[n]->index];
   }
+  assert(std::equal(cnt_games_together.begin(), cnt_games_together.end(),
+                    s->cnt_games_together.begin()));
+  assert(min_games == st.min_games);
+  assert(max_games == st.max_games);
 
   int cnt_goalkeeper = 0;
-  int min_score = INT_MAX;
-  int max_score = 0;
   int min_ledare = INT_MAX;
+  uint64_t hash = 0;
   vector<int> scores;
-  double sum_score = 0;
-  double sum_score2 = 0;
   for (Game * g : s->games) {
-    int score = g->get_score();
-    scores.push_back(score);
-    if (score < min_score)
-      min_score = score;
-    if (score > max_score)
-      max_score = score;
+    for (Player * p : g->players) {
+      hash ^= s->zobrist[g->index * players.size() + p->index];
+      assert(s->round_game[g->round * players.size() + p->index] ==
+             g->index + 1);
+    }
+    scores.push_back(g->get_score());
     if (g->ledare < min_ledare)
       min_ledare = g->ledare;
     if (g->goalkeeper > 0)
       cnt_goalkeeper++;
-    sum_score += score;
-    sum_score2 += (score * score);
   }
   std::sort(scores.begin(), scores.end());
-  s->stats.min_score = min_score;
-  s->stats.median_score = scores[scores.size() / 2];
-  s->stats.max_score = max_score;
-  s->stats.std_score = sqrt(sum_score*sum_score - sum_score2)/scores.size();
-  s->stats.min_ledare = min_ledare;
-  s->stats.cnt_goalkeeper = cnt_goalkeeper;
+  assert(st.min_score == scores[0]);
+  assert(st.median_score == scores[scores.size() / 2]);
+  assert(st.max_score == scores[scores.size() - 1]);
+  assert(st.min_ledare == min_ledare);
+  assert(st.cnt_goalkeeper == cnt_goalkeeper);
+  assert(s->hash == hash);
+}
+
+/**
+ * Everything but the score order statistics is kept up to date by
+ * add_player_to_game()/remove_player_from_game(), so this is cheap
+ */
+void
+compute_stats(Sched * s) {
+  Stats & st = s->stats;
+  int cnt = s->games.size();
+  st.min_score = s->scores.kth(0);
+  st.median_score = s->scores.kth(cnt / 2);
+  st.max_score = s->scores.kth(cnt - 1);
+  double sum_score = st.sum_score;
+  double sum_score2 = st.sum_score2;
+  st.std_score = sqrt(sum_score*sum_score - sum_score2)/cnt;
+  st.cnt_never_together = s->cnt_games_together[0];
+
+  if (VERIFY_STATS)
+    verify_stats(s);
+}
+
+/**
+ * Split players and games into classes of interchangeable ones:
+ *   players with the same score, ledare, goalkeeper, count_as, lost games
+ *   and mask, and games in the same round with the same unavailable_mask.
+ *   Swapping two of a class in a schedule doesn't change what compare()
+ *   sees, see canonical_hash().
+ */
+void
+find_symmetries(Team * t)
+{
+  const vector<Player*> & players = t->players;
+  t->player_class.assign(players.size(), -1);
+  int classes = 0;
+  for (size_t n = 0; n < players.size(); n++) {
+    if (t->player_class[n] >= 0)
+      continue;
+    const Player * p = players[n];
+    t->player_class[n] = classes;
+    for (size_t m = n + 1; m < players.size(); m++) {
+      const Player * p2 = players[m];
+      if (p2->score == p->score && p2->ledare == p->ledare &&
+          p2->goalkeeper == p->goalkeeper && p2->count_as == p->count_as &&
+          p2->lost_games == p->lost_games && p2->mask == p->mask)
+        t->player_class[m] = classes;
+    }
+    classes++;
+  }
+
+  const Sched * s = t->empty_sched;
+  t->game_class.assign(s->games.size(), -1);
+  int game_classes = 0;
+  for (size_t n = 0; n < s->games.size(); n++) {
+    if (t->game_class[n] >= 0)
+      continue;
+    const Game * g = s->games[n];
+    t->game_class[n] = game_classes;
+    for (size_t m = n + 1; m < s->games.size(); m++) {
+      const Game * g2 = s->games[m];
+      if (g2->round == g->round && g2->unavailable_mask == g->unavailable_mask)
+        t->game_class[m] = game_classes;
+    }
+    game_classes++;
+  }
+
+  fprintf(stderr, "symmetry: %d classes of %d players, %d of %d games\n",
+          classes, (int)players.size(), game_classes, (int)s->games.size());
+}
+
+static inline
+uint64_t
+mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Hash of s that is the same for all schedules that differ only by
+ *   swapping interchangeable players or games, see find_symmetries().
+ *
+ * Instead of sorting each class into a canonical order, players and games
+ *   are labelled by their class and the labels refined twice, a game by
+ *   the labels of its players and a player by the labels of its games.
+ *   The multisets are combined by addition, so order doesn't matter.
+ */
+uint64_t
+canonical_hash(const Sched * s)
+{
+  const vector<int> & player_class = team->player_class;
+  const vector<int> & game_class = team->game_class;
+  thread_local vector<uint64_t> pl;
+  thread_local vector<uint64_t> pl2;
+  thread_local vector<uint64_t> gl;
+  pl.resize(player_class.size());
+  pl2.resize(player_class.size());
+  gl.resize(game_class.size());
+
+  for (size_t p = 0; p < pl.size(); p++)
+    pl[p] = mix64(player_class[p] + 1);
+
+  uint64_t hash = 0;
+  for (int refine = 0; refine < 2; refine++) {
+    hash = 0;
+    for (const Game * g : s->games) {
+      uint64_t sum = 0;
+      for (const Player * p : g->players)
+        sum += pl[p->index];
+      gl[g->index] = mix64(mix64(game_class[g->index] + 1) ^ mix64(sum));
+      hash += gl[g->index];
+    }
+    std::copy(pl.begin(), pl.end(), pl2.begin());
+    for (const Game * g : s->games)
+      for (const Player * p : g->players)
+        pl2[p->index] += mix64(gl[g->index]);
+    for (size_t p = 0; p < pl.size(); p++)
+      pl[p] = mix64(pl2[p]);
+  }
+  return hash;
 }
 
 Player*
@@ -622,7 +1543,7 @@ Game*
 get_game(const Sched * s, Player * p)
 {
   Game * game = NULL;
-  const vector<Game*> & games = s->games;
+  const Games & games = s->games;
   for (size_t i = 0; i < games.size(); i++) {
     Game * g = games[i];
     if (test_bit(s->players_mask_per_round[g->round], p->index))
@@ -638,7 +1559,7 @@ get_game(const Sched * s, Player * p)
 
 int cnt_games(const Sched * s, Player * p)
 {
-  return s->stats.games_per_player[p->index] + p->lost_games;
+  return s->games_per_player[p->index] + p->lost_games;
 }
 
 Player*
@@ -661,8 +1582,8 @@ void
 print_stats(const Sched * s)
 {
   fprintf(stderr, "cnt: ");
-  for (size_t n = 0; n < s->stats.cnt_games_together.size(); n++) {
-    fprintf(stderr, "%ld-%d, ", n,  s->stats.cnt_games_together[n]);
+  for (size_t n = 0; n < s->cnt_games_together.size(); n++) {
+    fprintf(stderr, "%ld-%d, ", n,  s->cnt_games_together[n]);
   }
   fprintf(stderr, "\n");
 
@@ -679,9 +1600,9 @@ print_stats(const Sched * s)
           s->stats.max_games);
 
   fprintf(stderr,
-          "swaps: %d failed: ",
-          s->stats.swaps);
-  for (int i : s->stats.failed_swap) {
+          "swaps: %d exchanges: %d shifts: %d failed: ",
+          s->stats.swaps, s->stats.exchanges, s->stats.shifts);
+  for (int i : s->stats.failed) {
     fprintf(stderr,
             "%d ",
             i);
@@ -690,13 +1611,17 @@ print_stats(const Sched * s)
 }
 
 void
-print_sched(const Sched * s)
+print_sched(const Sched * s, FILE * out = stdout)
 {
+  const vector<Player*> & players = team->players;
+  vector<vector<Player*> > sorted;
   for (Game * g : s->games) {
-    sort(g->players.begin(), g->players.end(), sort_by_name);
+    vector<Player*> list(g->players.begin(), g->players.end());
+    sort(list.begin(), list.end(), sort_by_name);
+    sorted.push_back(list);
   }
 
-  for (int round = 0; round <= max_round; round++) {
+  for (int round = 0; round <= team->max_round; round++) {
     size_t pos = 0;
     for (; pos < s->games.size(); pos++)
       if (s->games[pos]->round == round)
@@ -705,17 +1630,17 @@ print_sched(const Sched * s)
     if (pos >= s->games.size())
       continue;
 
-    printf("%d", round);
+    fprintf(out, "%d", round);
     for (Game * g : s->games) {
       if (g->round == round)
-        printf(",%s %s,", g->time, g->desc);
+        fprintf(out, ",%s %s,", g->time, g->desc);
     }
-    printf("\n");
+    fprintf(out, "\n");
     for (Game * g : s->games) {
       if (g->round == round)
-        printf(",,score:%d ledare:%d goal: %d count: %d", g->get_score(), g->ledare, g->goalkeeper, g->count_players);
+        fprintf(out, ",,score:%d ledare:%d goal: %d count: %d", g->get_score(), g->ledare, g->goalkeeper, g->count_players);
     }
-    printf("\n");
+    fprintf(out, "\n");
 
     size_t p = 0;
     bool done = false;
@@ -724,18 +1649,19 @@ print_sched(const Sched * s)
       for (Game * g : s->games) {
         if (g->round != round)
           continue;
-        if (g->players.size() > p) {
+        const vector<Player*> & list = sorted[g->index];
+        if (list.size() > p) {
           done = false;
-          printf(",%s,", g->players[p]->name);
-	  if (g->players[p]->goalkeeper)
-	    printf("(G)");
-	  if (g->players[p]->ledare)
-	    printf("(L)");
+          fprintf(out, ",%s,", list[p]->name);
+	  if (list[p]->goalkeeper)
+	    fprintf(out, "(G)");
+	  if (list[p]->ledare)
+	    fprintf(out, "(L)");
         } else {
-          printf(",,");
+          fprintf(out, ",,");
         }
       }
-      printf("\n");
+      fprintf(out, "\n");
       p++;
     }
   }
@@ -745,13 +1671,13 @@ print_sched(const Sched * s)
   for (Player * p : players) {
     fprintf(stderr, "%s : %d games(%d), ",
             p->name,
-            s->stats.games_per_player[p->index],
+            s->games_per_player[p->index],
             p->lost_games);
     for (Player * p2 : players) {
       if (p != p2) {
         fprintf(stderr, "%s:%d ",
                 p2->name,
-                s->stats.games_together.at(p->index, p2->index));
+                s->games_together.at(p->index, p2->index));
       }
     }
     fprintf(stderr, "\n");
@@ -759,22 +1685,139 @@ print_sched(const Sched * s)
   fprintf(stderr, "\n");
 }
 
+/**
+ * Split buf at commas, in place
+ */
+static
+void
+split_fields(char * buf, vector<char*> & fields)
+{
+  fields.clear();
+  fields.push_back(buf);
+  for (char * c = strchr(buf, ','); c; c = strchr(c + 1, ',')) {
+    *c = 0;
+    fields.push_back(c + 1);
+  }
+}
+
+/**
+ * Read a schedule written by print_sched() back into a Sched of team
+ *
+ * Games are matched on round and "time desc", players on name. Games
+ * and players that are no longer in matcher.csv/spelare.csv, players
+ * that are now unavailable for a game, and second games in a round are
+ * skipped and counted. Returns NULL if the file can't be read.
+ */
+Sched*
+read_sched(const char * filename)
+{
+  FILE * f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return NULL;
+  }
+
+  Sched * s = copy_sched(team->empty_sched);
+  vector<Game*> columns;  // games of the current round, by column
+  vector<char*> fields;
+  int added = 0;
+  int unknown_games = 0;
+  int unknown_players = 0;
+  int unavailable = 0;
+  int round_taken = 0;
+  char * buf = NULL;
+  size_t sz = 0;
+  while (getline(&buf, &sz, f) > 0)
+  {
+    strip(buf);
+    if (buf[0] >= '0' && buf[0] <= '9') {
+      // round header: round,time desc,,time desc,...
+      split_fields(buf, fields);
+      int round = atoi(fields[0]);
+      columns.clear();
+      for (size_t i = 1; i < fields.size(); i += 2) {
+        Game * game = NULL;
+        for (Game * g : s->games) {
+          if (g->round != round)
+            continue;
+          std::string text = std::string(g->time) + " " + g->desc;
+          if (text == fields[i])
+            game = g;
+        }
+        if (game == NULL)
+          unknown_games++;
+        columns.push_back(game);
+      }
+      continue;
+    }
+
+    if (buf[0] != ',' || strncmp(buf, ",,score:", 8) == 0)
+      continue;
+
+    // players: ,name,(G)(L),name,...
+    split_fields(buf, fields);
+    for (size_t i = 1; i < fields.size(); i += 2) {
+      Game * g = (i - 1) / 2 < columns.size() ? columns[(i - 1) / 2] : NULL;
+      if (g == NULL || fields[i][0] == 0)
+        continue;
+      Player * player = NULL;
+      for (Player * p : team->players)
+        if (strcmp(p->name, fields[i]) == 0)
+          player = p;
+      if (player == NULL) {
+        unknown_players++;
+      } else if (test_bit(g->unavailable_mask, player->index)) {
+        unavailable++;
+      } else if (test_bit(s->players_mask_per_round[g->round],
+                          player->index)) {
+        round_taken++;
+      } else {
+        add_player_to_game(g, player);
+        added++;
+      }
+    }
+  }
+  free(buf);
+  fclose(f);
+
+  compute_stats(s);
+  fprintf(stderr, "%s: %d players in games, skipped %d unknown games,"
+          " %d unknown players, %d now unavailable, %d twice in a round\n",
+          filename, added, unknown_games, unknown_players, unavailable,
+          round_taken);
+  return s;
+}
+
+/**
+ * Number of players that are in a game in one schedule and not in the
+ *   other, summed over games
+ */
+int
+sched_changes(const Sched * s1, const Sched * s2)
+{
+  int changes = 0;
+  for (size_t i = 0; i < s1->games.size(); i++)
+    changes += count_bits(s1->games[i]->players_mask ^
+                          s2->games[i]->players_mask);
+  return changes;
+}
+
 Sched*
 create_base_sched()
 {
-  Sched * s = copy_sched(&empty_sched);
+  Sched * s = copy_sched(team->empty_sched);
 
-  vector<Game*> & games = s->games;
+  const Games & games = s->games;
 
   int cnt_players = 0;
   vector<Player*> players;
-  for (Player * p : ::players) {
+  for (Player * p : team->players) {
     players.push_back(p);
     cnt_players += abs(p->count_as);
   }
 
   for (Player * p : players) {
-    while (s->stats.games_per_player[p->index] + p->lost_games < games_per_player) {
+    while (s->games_per_player[p->index] + p->lost_games < team->games_per_player) {
       Game * g = get_game(s, p);
       if (g == NULL)
         break;
@@ -813,7 +1856,7 @@ int inc_together(Sched * s, Game * game, Player * player)
 {
   int cnt = 0;
   for (Player * p : game->players) {
-    if (s->stats.games_together.at(p->index, player->index) == 0)
+    if (s->games_together.at(p->index, player->index) == 0)
       cnt++;
   }
   return cnt;
@@ -862,7 +1905,7 @@ sort_by_score_rand(const Player * p1, const Player * p2)
 void rand_players(vector<Player*> & players)
 {
   for (Player * p : players) {
-    p->rand_no = rand();
+    p->rand_no = thread_rand.below(INT_MAX);
   }
   std::sort(players.begin(), players.end(), sort_by_score_rand);
 }
@@ -902,7 +1945,7 @@ int min_players(const vector<Game*> games) {
   return min;
 }
 
-bool too_many_players(const vector<Game*> & games, int limit) {
+bool too_many_players(const Games & games, int limit) {
   for (Game * g : games) {
     if (g->count_players > limit) {
       return true;
@@ -914,16 +1957,16 @@ bool too_many_players(const vector<Game*> & games, int limit) {
 Sched*
 create_base_sched2()
 {
-  Sched * s = copy_sched(&empty_sched);
+  Sched * s = copy_sched(team->empty_sched);
 
-  for (int round = 0; round <= max_round; round += rounds_per_team) {
+  for (int round = 0; round <= team->max_round; round += rounds_per_team) {
     vector<Game*> games;
     copy_games_in_round(games, s->games, round);
-    if (games.size() == 0) {
+    if (games.size() == 0 || round < team->free_round) {
       continue;
     }
 
-    vector<Player*> players = ::players;
+    vector<Player*> players = team->players;
     int p = round % players.size();
     while (test_bit(games[0]->unavailable_mask, players[p]->index))
       p++;
@@ -941,7 +1984,7 @@ create_base_sched2()
     for (int copy = 1; copy < rounds_per_team; copy++) {
       vector<Game*> copy_games;
       copy_games_in_round(copy_games, s->games, round + copy);
-      if (copy_games.size() == 0) {
+      if (copy_games.size() == 0 || round + copy < team->free_round) {
         continue;
       }
 
@@ -960,12 +2003,12 @@ create_base_sched2()
     }
   }
 
-  size_t total = file_games.size() * players_per_game;
-  int min_games_per_player = games_per_player;
+  size_t total = team->file_games.size() * players_per_game;
+  int min_games_per_player = team->games_per_player;
 
   for (int pi = 0; too_many_players(s->games, players_per_game); pi++) {
-    Player * p = players[fun(pi, players.size())];
-    if (s->stats.games_per_player[p->index] < min_games_per_player) {
+    Player * p = team->players[fun(pi, team->players.size())];
+    if (s->games_per_player[p->index] < min_games_per_player) {
       continue;
     }
 
@@ -973,6 +2016,8 @@ create_base_sched2()
     for (Game * g : s->games) {
       if (g->count_players <= players_per_game)
         continue;
+      if (g->round < team->free_round)
+        continue;
       if (!test_bit(g->players_mask, p->index))
         continue;
       int score = g->get_score();
@@ -987,7 +2032,7 @@ create_base_sched2()
     if (games.empty())
       continue;
 
-    Game * g = games[rand() % games.size()];
+    Game * g = games[thread_rand.below(games.size())];
     remove_player_from_game(g, p);
   }
 
@@ -1010,8 +2055,8 @@ struct sched_player
 bool
 sort_players_by_score(const sched_player p1, const sched_player p2)
 {
-  int c1 = p1.p->lost_games + p1.s->stats.games_per_player[p1.p->index];
-  int c2 = p2.p->lost_games + p2.s->stats.games_per_player[p2.p->index];
+  int c1 = p1.p->lost_games + p1.s->games_per_player[p1.p->index];
+  int c2 = p2.p->lost_games + p2.s->games_per_player[p2.p->index];
   if (c1 != c2)
     return c1 < c2;
   return sort_by_score(p1.p, p2.p);
@@ -1023,6 +2068,40 @@ sort_by_low_score(const Player * p1, const Player * p2)
   return !sort_by_score(p1, p2);
 }
 
+/**
+ * Add the players with count_as < 0, lowest score first, each to the
+ *   games with the lowest score, games_per_player times
+ */
+static
+void
+add_negative_players(Sched * s)
+{
+  vector<Player*> players;
+  for (Player * p : team->players) {
+    if (p->count_as < 0)
+      players.push_back(p);
+  }
+
+  vector<Game*> games(s->games.begin(), s->games.end());
+  std::sort(players.begin(), players.end(), sort_by_low_score);
+  for (int i = 0; i < team->games_per_player; i++)
+  {
+    for (Player * p : players)
+    {
+      std::sort(games.begin(), games.end(), sort_games_by_players_score);
+      for (int i = 0; i < games.size(); i++)
+      {
+        if (test_bit(games[i]->unavailable_mask, p->index))
+          continue;
+        if (test_bit(s->players_mask_per_round[games[i]->round], p->index))
+          continue;
+        add_player_to_game(games[i], p);
+        break;
+      }
+    }
+  }
+}
+
 /**
  * 1) Find game with least available players (and not full)
  * 2) Pick available players
@@ -1033,17 +2112,17 @@ sort_by_low_score(const Player * p1, const Player * p2)
  * 5) Add players=0 players
  */
 Sched*
-create_base_sched3(std::default_random_engine& generator)
+create_base_sched3(Rand & generator)
 {
-  Sched * s = copy_sched(&empty_sched);
+  Sched * s = copy_sched(team->empty_sched);
 
   vector<Player*> players;
-  for (Player * p : ::players) {
+  for (Player * p : team->players) {
     if (p->count_as > 0)
       players.push_back(p);
   }
 
-  vector<Game*> games = s->games;
+  vector<Game*> games(s->games.begin(), s->games.end());
 
   while (games.size()) {
     std::sort(games.begin(), games.end(), sort_games_by_available);
@@ -1083,31 +2162,7 @@ create_base_sched3(std::default_random_engine& generator)
       games.erase(games.begin());
   }
 
-  players.clear();
-  for (Player * p : ::players) {
-    if (p->count_as < 0)
-      players.push_back(p);
-  }
-
-  games = s->games;
-  std::sort(players.begin(), players.end(), sort_by_low_score);
-  for (int i = 0; i < games_per_player; i++)
-  {
-    for (Player * p : players)
-    {
-      std::sort(games.begin(), games.end(), sort_games_by_players_score);
-      for (int i = 0; i < games.size(); i++)
-      {
-        if (test_bit(games[i]->unavailable_mask, p->index))
-          continue;
-        if (test_bit(s->players_mask_per_round[games[i]->round], p->index))
-          continue;
-        add_player_to_game(games[i], p);
-        break;
-      }
-    }
-  }
-
+  add_negative_players(s);
   compute_stats(s);
 
 #if 0
@@ -1118,55 +2173,479 @@ create_base_sched3(std::default_random_engine& generator)
   return s;
 }
 
-int
-pct(int val1, int val2)
+/**
+ * Can player p be added to game g of s, leaving aside who else could
+ */
+static inline
+bool
+can_play(const Sched * s, const Game * g, const Player * p)
 {
-  return (100 * (val1 - val2)) / val1;
+  return p->count_as != 0 &&
+    !test_bit(g->unavailable_mask, p->index) &&
+    !test_bit(s->players_mask_per_round[g->round], p->index) &&
+    g->count_players + abs(p->count_as) <= players_per_game;
 }
 
-int
-compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
-  int res;
+static
+bool
+sort_games_by_round(const Game * g1, const Game * g2)
+{
+  if (g1->round != g2->round)
+    return g1->round < g2->round;
+  return g1->index < g2->index;
+}
 
-#define S1_WIN -1
-#define S2_WIN 1
+/**
+ * The games of s that are not frozen, by round
+ */
+vector<Game*>
+free_games_by_round(Sched * s)
+{
+  vector<Game*> order;
+  for (int i : team->free_games)
+    order.push_back(s->games[i]);
+  std::sort(order.begin(), order.end(), sort_games_by_round);
+  return order;
+}
 
-  if (s1->stats.min_games >= games_per_player &&
-      s2->stats.min_games < games_per_player)
-  {
-    return S1_WIN;
-  }
+/**
+ * Players split between the games of a round, with their score sums,
+ *   see create_base_sched4()
+ */
+struct Partition
+{
+  vector<long long> sum;         // [game]
+  vector<vector<Player*> > part; // [game]
 
-  if (s1->stats.min_games < games_per_player &&
-      s2->stats.min_games >= games_per_player)
-  {
-    if (PRINT_COMPARE)
-    {
-      fprintf(stderr, "\n%u min_games => %u\n", __LINE__, s2->stats.min_games);
-      print_stats(s2);
-    }
-    return S2_WIN;
+  long long spread() const {
+    return *std::max_element(sum.begin(), sum.end()) -
+      *std::min_element(sum.begin(), sum.end());
   }
+};
 
-  if (s1->stats.max_games < games_per_player + cmp_games_diff &&
-      s2->stats.max_games >= games_per_player + cmp_games_diff)
-  {
-    return S1_WIN;
+static
+bool
+sort_by_spread(const Partition & a, const Partition & b)
+{
+  return a.spread() < b.spread();
+}
+
+/**
+ * Merge b into a, the largest sums of one with the smallest of the other
+ */
+static
+void
+combine(Partition & a, const Partition & b)
+{
+  size_t k = a.sum.size();
+  vector<int> ia(k), ib(k);
+  for (size_t i = 0; i < k; i++)
+    ia[i] = ib[i] = i;
+  std::sort(ia.begin(), ia.end(), [&a](int x, int y) {
+      return a.sum[x] < a.sum[y];
+    });
+  std::sort(ib.begin(), ib.end(), [&b](int x, int y) {
+      return b.sum[x] > b.sum[y];
+    });
+  for (size_t i = 0; i < k; i++) {
+    a.sum[ia[i]] += b.sum[ib[i]];
+    a.part[ia[i]].insert(a.part[ia[i]].end(),
+                         b.part[ib[i]].begin(), b.part[ib[i]].end());
   }
+}
 
-  if (s1->stats.max_games >= games_per_player + cmp_games_diff &&
-      s2->stats.max_games < games_per_player + cmp_games_diff)
-  {
-    if (PRINT_COMPARE)
-    {
-      fprintf(stderr, "\n%u max_games => %u\n", __LINE__, s2->stats.max_games);
-      print_stats(s2);
+/**
+ * How far g is from cmp_min_ledare ledare and a goalkeeper
+ */
+static
+int
+quota_deficit(int ledare, int goalkeeper)
+{
+  return std::max(cmp_min_ledare - ledare, 0) + (goalkeeper <= 0);
+}
+
+/**
+ * Swap players between the games of a round while that brings games
+ *   closer to their ledare and goalkeeper quota, closest score first
+ */
+static
+void
+balance_quotas(const vector<Game*> & games)
+{
+  for (int iter = 0; iter < 2 * players_per_game; iter++) {
+    int best_gain = 0;
+    int best_diff = INT_MAX;
+    Game * bg = NULL;
+    Game * bg2 = NULL;
+    Player * bp = NULL;
+    Player * bq = NULL;
+    for (Game * g : games) {
+      for (Game * g2 : games) {
+        if (g == g2)
+          continue;
+        int before = quota_deficit(g->ledare, g->goalkeeper) +
+          quota_deficit(g2->ledare, g2->goalkeeper);
+        // p from g2 to g, q from g to g2
+        for (Player * p : g2->players) {
+          if (test_bit(g->unavailable_mask, p->index))
+            continue;
+          for (Player * q : g->players) {
+            if (test_bit(g2->unavailable_mask, q->index) ||
+                g->count_players - abs(q->count_as) + abs(p->count_as) >
+                players_per_game ||
+                g2->count_players - abs(p->count_as) + abs(q->count_as) >
+                players_per_game)
+              continue;
+            int dl = !!p->ledare - !!q->ledare;
+            int dg = p->goalkeeper - q->goalkeeper;
+            int after = quota_deficit(g->ledare + dl, g->goalkeeper + dg) +
+              quota_deficit(g2->ledare - dl, g2->goalkeeper - dg);
+            int diff = abs(p->score - q->score);
+            if (before - after > best_gain ||
+                (before - after == best_gain && best_gain > 0 &&
+                 diff < best_diff)) {
+              best_gain = before - after;
+              best_diff = diff;
+              bg = g;
+              bg2 = g2;
+              bp = p;
+              bq = q;
+            }
+          }
+        }
+      }
     }
-    return S2_WIN;
+    if (best_gain == 0)
+      return;
+    remove_player_from_game(bg2, bp);
+    remove_player_from_game(bg, bq);
+    add_player_to_game(bg, bp);
+    add_player_to_game(bg2, bq);
   }
+}
 
-  if (s1->stats.min_ledare < cmp_min_ledare &&
-      s2->stats.min_ledare >= cmp_min_ledare) {
+/**
+ * Fill the games of one round: the players with the fewest games go,
+ *   split between the games by balanced largest differencing
+ *   (Karmarkar-Karp for k sets of equal size) on score
+ */
+static
+void
+partition_round(Sched * s, const vector<Game*> & games, Rand & generator)
+{
+  size_t k = games.size();
+  int round = games[0]->round;
+  int room = 0;
+  for (Game * g : games)
+    room += std::max(players_per_game - g->count_players, 0);
+
+  // fewest games first, in random order among equals
+  vector<std::pair<uint64_t, Player*> > pool;
+  for (Player * p : team->players) {
+    if (p->count_as <= 0 ||
+        test_bit(s->players_mask_per_round[round], p->index))
+      continue;
+    bool available = false;
+    for (Game * g : games)
+      available |= !test_bit(g->unavailable_mask, p->index);
+    if (!available)
+      continue;
+    uint64_t games_played = p->lost_games + s->games_per_player[p->index];
+    pool.push_back(std::make_pair((games_played << 32) |
+                                  (uint32_t)generator.next(), p));
+  }
+  std::sort(pool.begin(), pool.end());
+
+  vector<Player*> chosen;
+  for (const auto & e : pool) {
+    if (e.second->count_as <= room) {
+      chosen.push_back(e.second);
+      room -= e.second->count_as;
+    }
+  }
+  if (chosen.empty())
+    return;
+
+  // k-tuples of players next to each other by score, one per game
+  std::sort(chosen.begin(), chosen.end(), sort_by_score);
+  vector<Partition> parts;
+  for (size_t i = 0; i < chosen.size(); i += k) {
+    Partition t;
+    t.sum.assign(k, 0);
+    t.part.resize(k);
+    for (size_t j = 0; j < k && i + j < chosen.size(); j++) {
+      t.sum[j] = chosen[i + j]->score;
+      t.part[j].push_back(chosen[i + j]);
+    }
+    parts.push_back(t);
+  }
+  std::make_heap(parts.begin(), parts.end(), sort_by_spread);
+  while (parts.size() > 1) {
+    std::pop_heap(parts.begin(), parts.end(), sort_by_spread);
+    Partition b = parts.back();
+    parts.pop_back();
+    std::pop_heap(parts.begin(), parts.end(), sort_by_spread);
+    combine(parts.back(), b);
+    std::push_heap(parts.begin(), parts.end(), sort_by_spread);
+  }
+  const Partition & result = parts[0];
+
+  // sets to games, with the fewest players that can't play there
+  vector<int> perm(k);
+  for (size_t j = 0; j < k; j++)
+    perm[j] = j;
+  vector<int> best_perm = perm;
+  int best_bad = INT_MAX;
+  do {
+    int bad = 0;
+    for (size_t j = 0; j < k; j++)
+      for (Player * p : result.part[perm[j]])
+        bad += test_bit(games[j]->unavailable_mask, p->index);
+    if (bad < best_bad) {
+      best_bad = bad;
+      best_perm = perm;
+    }
+  } while (best_bad > 0 && k <= 4 &&
+           std::next_permutation(perm.begin(), perm.end()));
+
+  vector<Player*> left;
+  for (size_t j = 0; j < k; j++) {
+    for (Player * p : result.part[best_perm[j]]) {
+      if (can_play(s, games[j], p))
+        add_player_to_game(games[j], p);
+      else
+        left.push_back(p);
+    }
+  }
+  for (Player * p : left) {
+    Game * to = NULL;
+    for (Game * g : games)
+      if (can_play(s, g, p) && (!to || g->count_players < to->count_players))
+        to = g;
+    if (to)
+      add_player_to_game(to, p);
+  }
+
+  balance_quotas(games);
+}
+
+/**
+ * Like create_base_sched3(), but each round is filled at once with
+ *   partition_round(), so that the games of a round get about the same
+ *   score, and the ledare and goalkeepers are shared between them
+ */
+Sched*
+create_base_sched4(Rand & generator)
+{
+  Sched * s = copy_sched(team->empty_sched);
+  vector<Game*> order = free_games_by_round(s);
+  for (size_t first = 0; first < order.size(); ) {
+    size_t end = first;
+    while (end < order.size() && order[end]->round == order[first]->round)
+      end++;
+    vector<Game*> games(order.begin() + first, order.begin() + end);
+    partition_round(s, games, generator);
+    first = end;
+  }
+
+  add_negative_players(s);
+  compute_stats(s);
+  return s;
+}
+
+/**
+ * Change in pairs that have met if p leaves from, where q stays behind,
+ *   and joins to
+ */
+static
+int
+meet_gain(const Sched * s, Player * p, const Game * from, const Game * to,
+          Player * q)
+{
+  int gain = 0;
+  for (Player * r : from->players)
+    if (r != p && s->games_together.at(p->index, r->index) == 1)
+      gain--;
+  for (Player * r : to->players)
+    if (r != q && s->games_together.at(p->index, r->index) == 0)
+      gain++;
+  return gain;
+}
+
+/**
+ * Swap players that count the same between the games of a round, while
+ *   that makes more pairs of players meet and doesn't lower the lower
+ *   score of the two games
+ */
+static
+void
+spread_pairs(Sched * s, const vector<Game*> & games)
+{
+  for (int iter = 0; iter < 2 * players_per_game; iter++) {
+    int best_gain = 0;
+    Game * bg = NULL;
+    Game * bg2 = NULL;
+    Player * bp = NULL;
+    Player * bq = NULL;
+    for (size_t i = 0; i < games.size(); i++) {
+      Game * g = games[i];
+      for (size_t j = i + 1; j < games.size(); j++) {
+        Game * g2 = games[j];
+        int before = std::min(g->get_score(), g2->get_score());
+        for (Player * p : g->players) {
+          if (p->count_as <= 0 || test_bit(g2->unavailable_mask, p->index))
+            continue;
+          for (Player * q : g2->players) {
+            if (q->count_as != p->count_as || !!q->ledare != !!p->ledare ||
+                q->goalkeeper != p->goalkeeper ||
+                test_bit(g->unavailable_mask, q->index))
+              continue;
+            int gain = meet_gain(s, p, g, g2, q) + meet_gain(s, q, g2, g, p);
+            if (gain <= best_gain)
+              continue;
+            int diff = q->score - p->score;
+            int after = std::min((g->score + diff) / g->count_players,
+                                 (g2->score - diff) / g2->count_players);
+            if (after < before)
+              continue;
+            best_gain = gain;
+            bg = g;
+            bg2 = g2;
+            bp = p;
+            bq = q;
+          }
+        }
+      }
+    }
+    if (best_gain == 0)
+      return;
+    remove_player_from_game(bg, bp);
+    remove_player_from_game(bg2, bq);
+    add_player_to_game(bg, bq);
+    add_player_to_game(bg2, bp);
+  }
+}
+
+/**
+ * Take the players that count out of g
+ */
+void
+clear_game(Game * g)
+{
+  vector<Player*> players;
+  for (Player * p : g->players)
+    if (p->count_as > 0)
+      players.push_back(p);
+  for (Player * p : players)
+    remove_player_from_game(g, p);
+}
+
+/**
+ * Large neighbourhood move: take the players out of the games of a
+ *   random round, or of a block of rounds_per_team rounds, and fill them
+ *   again with partition_round() and spread_pairs(). The other rounds are
+ *   kept, and their games per player and games together decide who plays
+ *   and with whom. Players that don't count are left where they are.
+ */
+void
+rebuild_rounds(Sched * s, Rand & generator)
+{
+  vector<Game*> order = free_games_by_round(s);
+  if (order.empty())
+    return;
+  int first = order.front()->round;
+  int r0 = first + generator.below(order.back()->round - first + 1);
+  int r1 = r0;
+  if (generator.below(2)) {
+    r0 -= r0 % rounds_per_team;
+    r1 = r0 + rounds_per_team - 1;
+  }
+
+  vector<vector<Game*> > rounds;
+  for (Game * g : order) {
+    if (g->round < r0 || g->round > r1)
+      continue;
+    if (rounds.empty() || rounds.back()[0]->round != g->round)
+      rounds.push_back(vector<Game*>());
+    rounds.back().push_back(g);
+    clear_game(g);
+  }
+
+  for (size_t i = rounds.size(); i > 1; i--)
+    std::swap(rounds[i - 1], rounds[generator.below(i)]);
+  for (const vector<Game*> & games : rounds) {
+    partition_round(s, games, generator);
+    spread_pairs(s, games);
+  }
+}
+
+/**
+ * Relative change from val1 to val2 in percent; any change away
+ *   from zero counts as a full 100 (a start schedule with an empty
+ *   game has min_score 0)
+ */
+int
+pct(int val1, int val2)
+{
+  if (val1 == 0)
+    return val2 == 0 ? 0 : 100;
+  return (100 * (val1 - val2)) / val1;
+}
+
+/**
+ * Compare stats s1 (of a previous version of a schedule)
+ *   with schedule s2
+ *
+ * When all criteria are within their tolerances, s2 wins at random one
+ *   time in twenty if its min_score is no lower. If strict, they are
+ *   compared again without tolerances, in the same order, so the result
+ *   doesn't depend on the random generator and s2 only wins if it is
+ *   really better.
+ */
+int
+compare(const Stats * s1, const Sched * s2, bool PRINT_COMPARE,
+        bool strict = false) {
+  int res;
+
+#define S1_WIN -1
+#define S2_WIN 1
+
+  if (s1->min_games >= team->games_per_player &&
+      s2->stats.min_games < team->games_per_player)
+  {
+    return S1_WIN;
+  }
+
+  if (s1->min_games < team->games_per_player &&
+      s2->stats.min_games >= team->games_per_player)
+  {
+    if (PRINT_COMPARE)
+    {
+      fprintf(stderr, "\n%u min_games => %u\n", __LINE__, s2->stats.min_games);
+      print_stats(s2);
+    }
+    return S2_WIN;
+  }
+
+  if (s1->max_games < team->games_per_player + cmp_games_diff &&
+      s2->stats.max_games >= team->games_per_player + cmp_games_diff)
+  {
+    return S1_WIN;
+  }
+
+  if (s1->max_games >= team->games_per_player + cmp_games_diff &&
+      s2->stats.max_games < team->games_per_player + cmp_games_diff)
+  {
+    if (PRINT_COMPARE)
+    {
+      fprintf(stderr, "\n%u max_games => %u\n", __LINE__, s2->stats.max_games);
+      print_stats(s2);
+    }
+    return S2_WIN;
+  }
+
+  if (s1->min_ledare < cmp_min_ledare &&
+      s2->stats.min_ledare >= cmp_min_ledare) {
     if (PRINT_COMPARE)
     {
       fprintf(stderr, "\n%u min_ledare => %u\n",
@@ -1176,15 +2655,15 @@ compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
     return S2_WIN;
   }
 
-  if (s1->stats.min_ledare >= cmp_min_ledare &&
+  if (s1->min_ledare >= cmp_min_ledare &&
       s2->stats.min_ledare < cmp_min_ledare) {
     return S1_WIN;
   }
 
-  if (s1->stats.cnt_goalkeeper > s2->stats.cnt_goalkeeper)
+  if (s1->cnt_goalkeeper > s2->stats.cnt_goalkeeper)
     return S1_WIN;
 
-  if (s1->stats.cnt_goalkeeper < s2->stats.cnt_goalkeeper)
+  if (s1->cnt_goalkeeper < s2->stats.cnt_goalkeeper)
   {
     if (PRINT_COMPARE)
     {
@@ -1195,10 +2674,10 @@ compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
     return S2_WIN;
   }
 
-  int min_pct = pct(s1->stats.min_score, s2->stats.min_score);
+  int min_pct = pct(s1->min_score, s2->stats.min_score);
   if (abs(min_pct) > 3)
   {
-    if (s2->stats.min_score > s1->stats.min_score)
+    if (s2->stats.min_score > s1->min_score)
     {
       if (PRINT_COMPARE)
       {
@@ -1207,13 +2686,13 @@ compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
         print_stats(s2);
       }
     }
-    return s2->stats.min_score - s1->stats.min_score;
+    return s2->stats.min_score - s1->min_score;
   }
 
-  int med_pct = pct(s1->stats.median_score, s2->stats.median_score);
+  int med_pct = pct(s1->median_score, s2->stats.median_score);
   if (abs(med_pct) > 10)
   {
-    if (s2->stats.median_score > s1->stats.median_score)
+    if (s2->stats.median_score > s1->median_score)
     {
       if (PRINT_COMPARE)
       {
@@ -1222,10 +2701,10 @@ compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
         print_stats(s2);
       }
     }
-    return s2->stats.median_score - s1->stats.median_score;
+    return s2->stats.median_score - s1->median_score;
   }
 
-  res = - (s2->stats.cnt_games_together[0] - s1->stats.cnt_games_together[0]);
+  res = - (s2->stats.cnt_never_together - s1->cnt_never_together);
 
   if (abs(res) > 5) {
     if (res > 0)
@@ -1233,14 +2712,14 @@ compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
       if (PRINT_COMPARE)
       {
         fprintf(stderr, "\n%u cnt_games_together[0] => %u\n",
-                __LINE__, s2->stats.cnt_games_together[0]);
+                __LINE__, s2->stats.cnt_never_together);
         print_stats(s2);
       }
     }
     return res;
   }
 
-  int max_pct = pct(s1->stats.max_score, s2->stats.max_score);
+  int max_pct = pct(s1->max_score, s2->stats.max_score);
   if (abs(max_pct) > 10)
   {
     if (PRINT_COMPARE)
@@ -1249,276 +2728,3162 @@ compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE) {
               __LINE__, s2->stats.max_score);
       print_stats(s2);
     }
-    return s2->stats.max_score - s1->stats.max_score;
+    return s2->stats.max_score - s1->max_score;
+  }
+
+  if (strict) {
+    if (s2->stats.min_score != s1->min_score)
+      return s2->stats.min_score - s1->min_score;
+    if (s2->stats.median_score != s1->median_score)
+      return s2->stats.median_score - s1->median_score;
+    if (s2->stats.cnt_never_together != s1->cnt_never_together)
+      return s1->cnt_never_together - s2->stats.cnt_never_together;
+    return s2->stats.max_score - s1->max_score;
   }
 
-  if (s2->stats.min_score >= s1->stats.min_score)
-    return ((rand() % 100) - 95);
+  if (s2->stats.min_score >= s1->min_score)
+    return ((int)thread_rand.below(100) - 95);
 
   return 0;
 }
 
-// Find 2 player that never play together
-// move 1 of them so that they do play one game together
-bool
-perm0(Sched * s, std::default_random_engine &generator)
+int
+compare(const Sched * s1, const Sched * s2, bool PRINT_COMPARE,
+        bool strict = false) {
+  return compare(&s1->stats, s2, PRINT_COMPARE, strict);
+}
+
+/**
+ * A single number for how bad a schedule is, lower is better, for anneal()
+ *
+ * Covers the same criteria as compare() with weights in roughly the same
+ *   order of priority. Instead of just min/max games and min_ledare it
+ *   counts how far off every player/game is (from the histograms behind
+ *   those stats), so that fixing one of several bad games is rewarded.
+ */
+int
+energy(const Sched * s)
 {
-  mask_t candidates = 0;
-  for (size_t n = 0; n < players.size(); n++) {
-    for (size_t m = n + 1; m < players.size(); m++) {
-      if (players[n]->count_as != players[m]->count_as)
-        continue;
-      if (s->stats.games_together.at(n,m) == 0) {
-	set_bit(candidates, n);
-	set_bit(candidates, m);
-      }
-    }
+  const Stats * st = &s->stats;
+  int max_games = team->games_per_player + cmp_games_diff - 1;
+  int e = 0;
+  for (size_t n = 0; n < s->cnt_games.size(); n++) {
+    if ((int)n < team->games_per_player)
+      e += 1000 * s->cnt_games[n] * (team->games_per_player - n);
+    else if ((int)n > max_games)
+      e += 1000 * s->cnt_games[n] * (n - max_games);
   }
+  for (int n = 0; n < cmp_min_ledare; n++)
+    e += 500 * s->cnt_ledare[n] * (cmp_min_ledare - n);
+  e += 200 * ((int)s->games.size() - st->cnt_goalkeeper);
+  e += 10 * (team->max_player_score - st->min_score);
+  e += 3 * (team->max_player_score - st->median_score);
+  e += 10 * st->cnt_never_together;
+  e += team->max_player_score - st->max_score;
+  return e;
+}
 
-  if (candidates == 0)
-    return false;
+static
+bool
+sort_by_score_per_count(const std::pair<int, int> & a,
+                        const std::pair<int, int> & b)
+{
+  return (long long)a.first * b.second > (long long)b.first * a.second;
+}
 
-  Player * p0 = players[rand_bit(candidates)];
-  candidates = 0;
-  for (size_t m = 0; m < players.size(); m++) {
-    if (m == (unsigned)p0->index)
-      continue;
-    if (p0->count_as != players[m]->count_as)
-      continue;
-    if (s->stats.games_together.at(m, p0->index) == 0) {
-      set_bit(candidates, m);
+/**
+ * Upper bound on the average score of players with a total score and
+ *   count, when they get some of the available players (score, count)
+ *   and end up with a count from lo to hi.
+ *
+ * The best average for a count is of the best score per count first,
+ *   with a part of the last one.
+ */
+static
+int
+score_bound(int score, int count, vector<std::pair<int, int> > & available,
+            int lo, int hi)
+{
+  std::sort(available.begin(), available.end(), sort_by_score_per_count);
+  double sum = score;
+  double best = count >= lo && count > 0 ? sum / count : INT_MIN;
+  int c = count;
+  for (const auto & a : available) {
+    for (int k = 0; k < a.second && c < hi; k++) {
+      sum += (double)a.first / a.second;
+      c++;
+      if (c >= lo)
+        best = std::max(best, sum / c);
     }
   }
+  if (best == INT_MIN)
+    return count ? score / count : 0;
+  return (int)floor(best);
+}
 
-  std::uniform_int_distribution<int> dist0(0,s->games.size()-1);
-  size_t g0n = dist0(generator);
-  Game * g0 = 0;
-  for (size_t i = 0; i < s->games.size(); i++) {
-    Game * g = s->games[(g0n + i) % s->games.size()];
-    if (test_bit(g->players_mask, p0->index)) {
-      g0 = g;
-      break;
+/**
+ * Bounds on the stats of any schedule that completes s, where the games
+ *   order[pos..] are open and order[pos] can only get players from index
+ *   cursor on. Games not in order are done.
+ *
+ * Each stat that compare() wants high gets an upper bound, and
+ *   cnt_never_together a lower bound. max_games is the current one.
+ *   min_games is below games_per_player if not every player can get that
+ *   many, one per round, in the open slots.
+ *
+ * The scores are bounded by how many an open game can end up with. At
+ *   most it is full, and players with count_as < 0 can come on top as
+ *   add_negative_players() ignores players_per_game. At least it has the
+ *   ledare that min_ledare needs, and the slots that every player needs
+ *   to get games_per_player, if the bounds allow either. A schedule that
+ *   doesn't has lost to one that does before compare() gets to the scores.
+ *   The lowest score of a round is at most the average of all its players.
+ */
+Stats
+sched_bounds(const Sched * s, const vector<Game*> & order, int pos, int cursor)
+{
+  int gpp = team->games_per_player;
+  const vector<Player*> & players = team->players;
+  Stats b = s->stats;
+
+  // a round can take no more players than there are left for it
+  thread_local vector<char> open;
+  open.assign(s->games.size(), 0);
+  int open_slots = 0;
+  int round_slots = 0;
+  for (size_t i = pos; i < order.size(); i++) {
+    const Game * g = order[i];
+    open[g->index] = 1;
+    round_slots += std::max(players_per_game - g->count_players, 0);
+    if (i + 1 == order.size() || order[i + 1]->round != g->round) {
+      int left = 0;
+      for (const Player * p : players)
+        left += p->count_as != 0 &&
+          !test_bit(s->players_mask_per_round[g->round], p->index);
+      open_slots += std::min(round_slots, left);
+      round_slots = 0;
     }
   }
 
-  Player * p1 = players[rand_bit(candidates)];
-  Game * g1 = 0;
-  size_t g1n = dist0(generator);
-  for (size_t i = 0; i < s->games.size(); i++) {
-    Game * g = s->games[(g1n + i) % s->games.size()];
-    if (test_bit(g->players_mask, p1->index)) {
-      g1 = g;
-      break;
+  // games a player can still get, and the count it needs to get gpp
+  int missing = 0;
+  int needed = 0;
+  b.min_games = INT_MAX;
+  for (const Player * p : players) {
+    int games = s->games_per_player[p->index];
+    missing += std::max(gpp - games, 0);
+    needed += abs(p->count_as) * std::max(gpp - games, 0);
+    int last_round = -1;
+    for (size_t i = pos; i < order.size(); i++) {
+      const Game * g = order[i];
+      if (g->round == last_round ||
+          (i == (size_t)pos && p->index < cursor) ||
+          !can_play(s, g, p))
+        continue;
+      games++;
+      last_round = g->round;
     }
+    b.min_games = std::min(b.min_games, games);
   }
-
-  if (g0 == NULL || g1 == NULL)
-    return false;
-
-  // move p1 from g1 to g0...
-  // find player p2 in g0 that will swap with p1
-  candidates = g0->players_mask;
-  // p0 should not swap
-  clear_bit(candidates, p0->index);
-  // none of the players in g0 can swap
-  candidates &= ~s->players_mask_per_round[g1->round];
-
-#define PRINT_SWAP 0
-  if (candidates == 0) {
-    s->stats.failed_swap[0]++;
-    return true;
+  if (missing > open_slots)
+    b.min_games = std::min(b.min_games, gpp - 1);
+
+  thread_local vector<int> scores;
+  scores.clear();
+  b.min_ledare = INT_MAX;
+  b.cnt_goalkeeper = 0;
+  for (const Game * g : s->games) {
+    if (open[g->index])
+      continue;
+    scores.push_back(g->get_score());
+    b.min_ledare = std::min(b.min_ledare, g->ledare);
+    b.cnt_goalkeeper += g->goalkeeper > 0;
   }
 
-  unsigned cnt = 0;
-  Player * swap[MAX_PLAYER];
-  for (size_t i = 0; i < MAX_PLAYER; i++) {
-    if (test_bit(candidates, i)) {
-      if (players[i]->count_as != p1->count_as)
+  // the open games get some of the players still available for them
+  size_t cnt_open = order.size() - pos;
+  thread_local vector<vector<std::pair<int, int> > > available; // score, count
+  thread_local vector<int> room; // [i - pos] count a game can still get
+  thread_local vector<int> round_room; // [i - pos] of its round
+  thread_local vector<mask_t> meet; // [player] who it can still meet
+  available.resize(cnt_open);
+  room.assign(cnt_open, 0);
+  round_room.assign(cnt_open, 0);
+  meet.resize(players.size());
+  for (mask_t & m : meet)
+    m = 0;
+  int open_pairs = 0;
+  int total_room = 0;
+  int keeper_games = 0;   // open games of the round that could get one
+  size_t first = pos;     // of the round
+  int round_sum = 0;      // room of the games of the round
+  for (size_t i = pos; i < order.size(); i++) {
+    const Game * g = order[i];
+    vector<std::pair<int, int> > & av = available[i - pos];
+    av.clear();
+    int ledare = g->ledare;
+    bool keeper = false;
+    int full = std::max(players_per_game - g->count_players, 0);
+    int total = 0;    // count of available with count_as > 0
+    int negative = 0; // and < 0
+    mask_t in = g->players_mask;
+    for (size_t p = i == (size_t)pos ? cursor : 0; p < players.size(); p++) {
+      const Player * q = players[p];
+      int count = abs(q->count_as);
+      if (q->count_as == 0 || (q->count_as > 0 && count > full) ||
+          test_bit(g->unavailable_mask, p) ||
+          test_bit(s->players_mask_per_round[g->round], p))
         continue;
-      if (test_bit(g1->unavailable_mask, players[i]->index))
-        continue;
-      swap[cnt++] = players[i];
+      set_bit(in, p);
+      av.push_back(std::make_pair(q->score, count));
+      if (q->count_as > 0)
+        total += count;
+      else
+        negative += count;
+      ledare += !!q->ledare;
+      keeper |= q->goalkeeper > 0;
+    }
+    for (int p = next_bit(in, 0); p >= 0; p = next_bit(in, p + 1))
+      or_mask(meet[p], in);
+    b.min_ledare = std::min(b.min_ledare, ledare);
+    room[i - pos] = std::min(total, full) + negative;
+    int most = g->count_players + room[i - pos];
+    open_pairs += most * (most - 1) / 2;
+    round_sum += room[i - pos];
+
+    // a goalkeeper plays one game per round
+    if (g->goalkeeper > 0)
+      b.cnt_goalkeeper++;
+    else
+      keeper_games += keeper;
+    if (i + 1 == order.size() || order[i + 1]->round != g->round) {
+      int keepers = 0;
+      int left = 0;
+      for (const Player * p : players) {
+        if (p->count_as == 0 ||
+            test_bit(s->players_mask_per_round[g->round], p->index))
+          continue;
+        keepers += p->goalkeeper > 0;
+        left += abs(p->count_as);
+      }
+      b.cnt_goalkeeper += std::min(keeper_games, keepers);
+      keeper_games = 0;
+      for (size_t j = first; j <= i; j++)
+        round_room[j - pos] = std::min(round_sum, left);
+      total_room += std::min(round_sum, left);
+      first = i + 1;
+      round_sum = 0;
     }
   }
 
-  if (cnt == 0)
-    return true;
-
-  std::uniform_int_distribution<int> dist1(0,cnt-1);
-  p0 = swap[dist1(generator)];
-
-  if (test_bit(s->players_mask_per_round[g1->round], p0->index)) {
-    s->stats.failed_swap[2]++;
-    return true;
-  }
-
-  if (test_bit(s->players_mask_per_round[g0->round], p1->index)) {
-    s->stats.failed_swap[3]++;
-    return true;
-  }
-
-  if (test_bit(g0->unavailable_mask, p1->index)) {
-    s->stats.failed_swap[4]++;
-    return true;
+  int min_score = INT_MAX;
+  int round_score = 0;
+  int round_count = 0;
+  int round_lo = 0;
+  int round_hi = 0;
+  thread_local vector<std::pair<int, int> > pool; // of the round
+  for (size_t i = pos; i < order.size(); i++) {
+    const Game * g = order[i];
+    int lo = g->count_players;
+    if (b.min_ledare >= cmp_min_ledare)
+      lo += std::max(cmp_min_ledare - g->ledare, 0);
+    if (b.min_games >= gpp) {
+      // what the other games can take at most, the rest has to go here
+      int others = total_room - round_room[i - pos];
+      int same = 0;
+      for (size_t j = pos; j < order.size(); j++)
+        if (j != i && order[j]->round == g->round)
+          same += room[j - pos];
+      others += std::min(same, round_room[i - pos]);
+      lo = std::max(lo, g->count_players + needed - others);
+    }
+    int hi = g->count_players + room[i - pos];
+    lo = std::min(lo, hi);
+    scores.push_back(score_bound(g->score, g->count_players,
+                                 available[i - pos], lo, hi));
+
+    round_score += g->score;
+    round_count += g->count_players;
+    round_lo += lo;
+    round_hi += hi;
+    if (i + 1 == order.size() || order[i + 1]->round != g->round) {
+      pool.clear();
+      for (const Player * p : players)
+        if (p->count_as != 0 &&
+            !test_bit(s->players_mask_per_round[g->round], p->index))
+          pool.push_back(std::make_pair(p->score, abs(p->count_as)));
+      min_score = std::min(min_score, score_bound(round_score, round_count,
+                                                  pool, round_lo, round_hi));
+      round_score = round_count = round_lo = round_hi = 0;
+    }
   }
+  std::sort(scores.begin(), scores.end());
+  b.min_score = std::min(scores[0], min_score);
+  b.median_score = scores[scores.size() / 2];
+  b.max_score = scores.back();
 
-  if (PRINT_SWAP)
-    fprintf(stderr, "swap %s(%d):%s and %s(%d):%s\n",
-	    p0->name, p0->count_as, g0->desc,
-            p1->name, p1->count_as, g1->desc);
-
-  remove_player_from_game(g0, p0);
-  add_player_to_game(g1, p0);
-
-  remove_player_from_game(g1, p1);
-  add_player_to_game(g0, p1);
+  // pairs that never played together and have no game left to meet in
+  int apart = 0;
+  for (size_t p = 0; p < players.size(); p++)
+    for (size_t q = p + 1; q < players.size(); q++)
+      if (s->games_together.at(p, q) == 0 && !test_bit(meet[p], q))
+        apart++;
+  b.cnt_never_together = std::max(apart,
+                                  s->cnt_games_together[0] - open_pairs);
+  return b;
+}
 
-  s->stats.swaps++;
+/**
+ * Compute team->bounds, the best stats any schedule can have
+ */
+void
+compute_bounds(Team * t)
+{
+  vector<Game*> order = free_games_by_round(t->empty_sched);
+  t->bounds = sched_bounds(t->empty_sched, order, 0, 0);
+  const Stats & b = t->bounds;
+  fprintf(stderr, "bounds: min_games %d min_ledare %d goalkeeper %d"
+          " min/median/max score %d/%d/%d never together %d\n",
+          b.min_games, b.min_ledare, b.cnt_goalkeeper,
+          b.min_score, b.median_score, b.max_score, b.cnt_never_together);
+}
 
+/**
+ * Can no schedule win over one with stats st in compare(), given the
+ *   bounds? Within compare()'s tolerances of the bounds is good enough.
+ */
+bool
+bounds_reached(const Stats & st)
+{
+  const Stats & b = team->bounds;
+  int gpp = team->games_per_player;
+  if (b.min_games >= gpp && st.min_games < gpp)
+    return false;
+  if (st.max_games >= gpp + cmp_games_diff)
+    return false;
+  if (b.min_ledare >= cmp_min_ledare && st.min_ledare < cmp_min_ledare)
+    return false;
+  if (st.cnt_goalkeeper < b.cnt_goalkeeper)
+    return false;
+  if (st.min_score <= 0 || abs(pct(st.min_score, b.min_score)) > 3)
+    return false;
+  if (st.median_score <= 0 || abs(pct(st.median_score, b.median_score)) > 10)
+    return false;
+  if (st.cnt_never_together - b.cnt_never_together > 5)
+    return false;
+  if (st.max_score <= 0 || abs(pct(st.max_score, b.max_score)) > 10)
+    return false;
   return true;
 }
 
-void
-permutate(Sched * s, std::default_random_engine &generator) {
-
-  for (int i = 0; i < 100; i++) {
-    if (!perm0(s, generator))
-      break;
-  }
+/**
+ * True if compare() would take a schedule with stats st over one with
+ *   stats goal, or find them equal within its tolerances. Used as the
+ *   target of bench_search().
+ */
+bool
+as_good_as(const Stats & st, const Stats & goal)
+{
+  int gpp = team->games_per_player;
+  int max_games = gpp + cmp_games_diff;
+  if ((st.min_games >= gpp) != (goal.min_games >= gpp))
+    return st.min_games >= gpp;
+  if ((st.max_games < max_games) != (goal.max_games < max_games))
+    return st.max_games < max_games;
+  if ((st.min_ledare >= cmp_min_ledare) != (goal.min_ledare >= cmp_min_ledare))
+    return st.min_ledare >= cmp_min_ledare;
+  if (st.cnt_goalkeeper != goal.cnt_goalkeeper)
+    return st.cnt_goalkeeper > goal.cnt_goalkeeper;
+  if (goal.min_score > 0 && abs(pct(goal.min_score, st.min_score)) > 3)
+    return st.min_score > goal.min_score;
+  if (goal.median_score > 0 && abs(pct(goal.median_score, st.median_score)) > 10)
+    return st.median_score > goal.median_score;
+  if (abs(st.cnt_never_together - goal.cnt_never_together) > 5)
+    return st.cnt_never_together < goal.cnt_never_together;
+  if (goal.max_score > 0 && abs(pct(goal.max_score, st.max_score)) > 10)
+    return st.max_score > goal.max_score;
+  return true;
 }
 
-struct Global
+/**
+ * Exhaustive search of one round, see polish_round()
+ */
+struct RoundSplit
 {
-  int streak;
-  int chars;
   Sched * s;
-  pthread_mutex_t mutex;
-
-  Global() { mutex = PTHREAD_MUTEX_INITIALIZER; streak = chars = 0; s = 0;}
-  Sched * promote(Sched * s2);
-} global;
+  vector<Game*> games;
+  vector<Player*> players;  // that count and can play in the round
+  vector<int> room;         // [game], players_per_game - count_players
+  vector<int> rest;         // [i * games + game], sum of count_as of
+                            // players[i..] that can play game
+  vector<int> choice;       // [player], game or -1
+  vector<int> best;         // choice of best_stats
+  Stats best_stats;
+  long leaves;
+  long nodes;
+  long max_leaves;          // give up after this many leaves, or
+                            // 64 times as many nodes
+  bool count_only;          // just count leaves
+};
 
-Sched * Global::promote(Sched * s2)
+/**
+ * Try every game, or none, for players[i..]. A player only sits out a
+ *   leaf if no game it can play has room for it.
+ */
+static
+void
+split_round(RoundSplit & r, size_t i)
 {
-  pthread_mutex_lock(&mutex);
-  int res = s ? compare(s, s2, true) : 1;
+  size_t k = r.games.size();
+  if (++r.nodes > 64 * r.max_leaves)
+    r.leaves = r.max_leaves + 1;
+  for (size_t j = 0; j < i; j++) {
+    if (r.choice[j] >= 0)
+      continue;
+    Player * p = r.players[j];
+    for (size_t g = 0; g < k; g++)
+      if (!test_bit(r.games[g]->unavailable_mask, p->index) &&
+          r.room[g] - r.rest[i * k + g] >= p->count_as)
+        return;
+  }
 
-  if (res < 0) {
-    streak++;
-    delete s2;
-  } else if (res == 0) {
-    streak++;
-    delete s2;
-  } else {
-    streak = 1;
-    delete s;
-    s = s2;
+  if (i == r.players.size()) {
+    r.leaves++;
+    if (r.count_only)
+      return;
+    compute_stats(r.s);
+    if (compare(&r.best_stats, r.s, false, true) > 0) {
+      r.best_stats = r.s->stats;
+      r.best = r.choice;
+    }
+    return;
   }
 
-  if (res > 0) {
-    chars++;
-    fputs("L", stderr);
-  } else {
-    chars++;
-    fputs("#", stderr);
+  Player * p = r.players[i];
+  for (int g = -1; g < (int)k && r.leaves <= r.max_leaves; g++) {
+    if (g >= 0 && (test_bit(r.games[g]->unavailable_mask, p->index) ||
+                   r.room[g] < p->count_as))
+      continue;
+    r.choice[i] = g;
+    if (g >= 0) {
+      r.room[g] -= p->count_as;
+      if (!r.count_only)
+        add_player_to_game(r.games[g], p);
+    }
+    split_round(r, i + 1);
+    if (g >= 0) {
+      r.room[g] += p->count_as;
+      if (!r.count_only)
+        remove_player_from_game(r.games[g], p);
+    }
   }
+  r.choice[i] = -1;
+}
 
-  if (chars == 79) {
-    fputs("\n", stderr);
-    chars = 0;
+/**
+ * Best split of the players between the games of one round by compare(),
+ *   with every other round as it is. Every split where no one left out
+ *   fits a game is tried, if there are at most max_leaves of them.
+ *
+ * Splits are compared strictly, and s is only changed if the best one
+ *   also wins over the split s had, as compare()'s tolerances aren't
+ *   transitive.
+ *   Returns true if s got better.
+ */
+bool
+polish_round(Sched * s, const vector<Game*> & games, long max_leaves)
+{
+  RoundSplit r;
+  r.s = s;
+  r.games = games;
+  size_t k = games.size();
+  compute_stats(s);
+  r.best_stats = s->stats;
+  Stats first_stats = s->stats;
+
+  // players that don't count keep their places
+  for (Player * p : team->players) {
+    if (p->count_as <= 0)
+      continue;
+    bool available = false;
+    for (Game * g : games)
+      available |= !test_bit(g->unavailable_mask, p->index);
+    if (available)
+      r.players.push_back(p);
+  }
+  size_t n = r.players.size();
+  r.choice.assign(n, -1);
+  for (size_t i = 0; i < n; i++)
+    for (size_t g = 0; g < k; g++)
+      if (test_bit(games[g]->players_mask, r.players[i]->index))
+        r.choice[i] = g;
+  r.best = r.choice;
+  for (Game * g : games)
+    clear_game(g);
+
+  r.room.resize(k);
+  for (size_t g = 0; g < k; g++)
+    r.room[g] = players_per_game - games[g]->count_players;
+  r.rest.assign((n + 1) * k, 0);
+  for (size_t i = n; i > 0; i--)
+    for (size_t g = 0; g < k; g++)
+      r.rest[(i - 1) * k + g] = r.rest[i * k + g] +
+        (test_bit(games[g]->unavailable_mask, r.players[i - 1]->index) ?
+         0 : r.players[i - 1]->count_as);
+
+  // m players that can play anywhere for fewer places give at least
+  // m choose places leaves
+  int room = 0;
+  int anywhere = 0;
+  for (size_t g = 0; g < k; g++)
+    room += r.room[g];
+  for (Player * p : r.players) {
+    bool everywhere = p->count_as == 1;
+    for (Game * g : games)
+      everywhere &= !test_bit(g->unavailable_mask, p->index);
+    anywhere += everywhere;
+  }
+  double choose = 1;
+  for (int j = 0; j < room && j < anywhere - room; j++)
+    choose = choose * (anywhere - j) / (j + 1);
+
+  r.max_leaves = max_leaves;
+  r.leaves = choose > max_leaves ? max_leaves + 1 : 0;
+  r.nodes = 0;
+  r.count_only = true;
+  vector<int> first = r.choice;
+  r.choice.assign(n, -1);
+  if (r.leaves == 0)
+    split_round(r, 0);
+  bool better = false;
+  if (r.leaves <= max_leaves) {
+    r.leaves = 0;
+    r.nodes = 0;
+    r.count_only = false;
+    r.choice.assign(n, -1);
+    split_round(r, 0);
   }
 
-  Sched * copy = copy_sched(s);
-  compute_stats(copy);
-  pthread_mutex_unlock(&mutex);
-  return copy;
+  if (r.best != first) {
+    for (size_t i = 0; i < n; i++)
+      if (r.best[i] >= 0)
+        add_player_to_game(games[r.best[i]], r.players[i]);
+    compute_stats(s);
+    better = compare(&first_stats, s, false, true) > 0;
+    if (better)
+      return true;
+    for (Game * g : games)
+      clear_game(g);
+    r.best = first;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    if (r.best[i] >= 0)
+      add_player_to_game(games[r.best[i]], r.players[i]);
+  compute_stats(s);
+  return better;
 }
 
-void *thread_main(void * arg)
+/**
+ * polish_round() every free round, in random order, until a sweep finds
+ *   nothing better. Returns true if s got better.
+ */
+bool
+polish(Sched * s, Rand & generator)
 {
-  std::default_random_engine generator;
-  generator.seed(time(0) + (long long)arg);
-  Sched * base = create_base_sched3(generator);
-  Sched * s = copy_sched(base);
-  compute_stats(s);
-  int chars = 0;
-  int streak = 1;
-  int wins = 0;
-  int loops = 0;
-  while (streak++ < 500000 && wins < 100000 && loops++ < 1000000 &&
-         stopnow == false) {
-    Sched * s2 = NULL;
-    switch(streak % 4) {
-    case 0:
-      s2 = copy_sched(s);
-      permutate(s2, generator);
+  vector<Game*> order = free_games_by_round(s);
+  vector<vector<Game*> > rounds;
+  for (Game * g : order) {
+    if (rounds.empty() || rounds.back()[0]->round != g->round)
+      rounds.push_back(vector<Game*>());
+    rounds.back().push_back(g);
+  }
+
+  bool better = false;
+  for (int sweep = 0; sweep < 3; sweep++) {
+    for (size_t i = rounds.size(); i > 1; i--)
+      std::swap(rounds[i - 1], rounds[generator.below(i)]);
+    bool found = false;
+    for (const vector<Game*> & games : rounds)
+      found |= polish_round(s, games, polish_leaves);
+    if (!found)
+      break;
+    better = true;
+  }
+  return better;
+}
+
+// Free games that p plays in, in round order
+static
+void
+player_games(const Sched * s, const Player * p, vector<Game*> & games)
+{
+  size_t n = team->players.size();
+  games.clear();
+  for (int r = team->free_round; r <= team->max_round; r++) {
+    int g = s->round_game[r * n + p->index];
+    if (g)
+      games.push_back(s->games[g - 1]);
+  }
+}
+
+// Find 2 player that never play together
+// move 1 of them so that they do play one game together
+//
+// Only moves that can be made are drawn: p1 from the players that are
+// free for g0 (not in its round, not unavailable), g1 from the games p1
+// is in, and the player swapped with p1 from the players of g0 that are
+// free for g1. Returns false only if there is no such move.
+bool
+perm0(Sched * s, Rand & generator)
+{
+  const vector<Player*> & players = team->players;
+  // both have to play a free game to be moved together
+  mask_t playing = 0;
+  for (int r = team->free_round; r <= team->max_round; r++)
+    or_mask(playing, s->players_mask_per_round[r]);
+
+  mask_t candidates = 0;
+  for (size_t n = 0; n < players.size(); n++) {
+    if (!test_bit(playing, n))
+      continue;
+    for (size_t m = n + 1; m < players.size(); m++) {
+      if (players[n]->count_as != players[m]->count_as ||
+          !test_bit(playing, m))
+        continue;
+      if (s->games_together.at(n,m) == 0) {
+	set_bit(candidates, n);
+	set_bit(candidates, m);
+      }
+    }
+  }
+
+  static thread_local vector<Game*> games0;
+  static thread_local vector<Game*> games1;
+  while (candidates != 0) {
+    Player * p0 = players[rand_bit(candidates)];
+    clear_bit(candidates, p0->index);
+    player_games(s, p0, games0);
+    if (games0.empty())
+      continue;
+    Game * g0 = games0[generator.below(games0.size())];
+
+    // players that are busy in g0's round or can't play g0
+    mask_t busy0 = s->players_mask_per_round[g0->round];
+    or_mask(busy0, g0->unavailable_mask);
+    mask_t candidates1 = 0;
+    for (size_t m = 0; m < players.size(); m++) {
+      if (m == (unsigned)p0->index || test_bit(busy0, m) ||
+          !test_bit(playing, m))
+        continue;
+      if (p0->count_as != players[m]->count_as)
+        continue;
+      if (s->games_together.at(m, p0->index) == 0)
+        set_bit(candidates1, m);
+    }
+
+    while (candidates1 != 0) {
+      Player * p1 = players[rand_bit(candidates1)];
+      clear_bit(candidates1, p1->index);
+      player_games(s, p1, games1);
+      size_t first = games1.empty() ? 0 : generator.below(games1.size());
+      for (size_t i = 0; i < games1.size(); i++) {
+        Game * g1 = games1[(first + i) % games1.size()];
+
+        // move p1 from g1 to g0...
+        // find player p2 in g0 that will swap with p1
+        mask_t swap_mask = g0->players_mask;
+        // p0 should not swap
+        clear_bit(swap_mask, p0->index);
+        // none of the players in g1's round can swap
+        swap_mask &= ~s->players_mask_per_round[g1->round];
+        swap_mask &= ~g1->unavailable_mask;
+
+        unsigned cnt = 0;
+        Player * swap[MAX_PLAYER];
+        for (int j = next_bit(swap_mask, 0); j >= 0;
+             j = next_bit(swap_mask, j + 1)) {
+          if (players[j]->count_as != p1->count_as)
+            continue;
+          swap[cnt++] = players[j];
+        }
+        if (cnt == 0)
+          continue;
+
+        Player * p2 = swap[generator.below(cnt)];
+
+#define PRINT_SWAP 0
+        if (PRINT_SWAP)
+          fprintf(stderr, "swap %s(%d):%s and %s(%d):%s\n",
+                  p2->name, p2->count_as, g0->desc,
+                  p1->name, p1->count_as, g1->desc);
+
+        remove_player_from_game(g0, p2);
+        add_player_to_game(g1, p2);
+
+        remove_player_from_game(g1, p1);
+        add_player_to_game(g0, p1);
+
+        s->stats.swaps++;
+        return true;
+      }
+    }
+  }
+
+  s->stats.failed[0]++;
+  return false;
+}
+
+// Replace a player in a random game with one that doesn't play in
+// that round, this changes the number of games per player which
+// perm0() can't do. Games are tried from a random one on until one has
+// a player with a replacement. Returns false if none has.
+bool
+perm1(Sched * s, Rand & generator)
+{
+  const vector<Player*> & players = team->players;
+  const vector<int> & free_games = team->free_games;
+  size_t first = generator.below(free_games.size());
+  for (size_t i = 0; i < free_games.size(); i++) {
+    Game * g = s->games[free_games[(first + i) % free_games.size()]];
+    if (g->players.size() == 0)
+      continue;
+
+    mask_t candidates = ~(s->players_mask_per_round[g->round] |
+                          g->unavailable_mask);
+    size_t p0n = generator.below(g->players.size());
+    for (size_t j = 0; j < g->players.size(); j++) {
+      Player * p0 = g->players[(p0n + j) % g->players.size()];
+      unsigned cnt = 0;
+      Player * replace[MAX_PLAYER];
+      for (int k = next_bit(candidates, 0);
+           k >= 0 && k < (int)players.size();
+           k = next_bit(candidates, k + 1)) {
+        if (players[k]->count_as != p0->count_as)
+          continue;
+        replace[cnt++] = players[k];
+      }
+      if (cnt == 0)
+        continue;
+
+      Player * p1 = replace[generator.below(cnt)];
+      remove_player_from_game(g, p0);
+      add_player_to_game(g, p1);
+      return true;
+    }
+  }
+
+  s->stats.failed[1]++;
+  return false;
+}
+
+// Exchange two players between games of the same round. Nobody's
+// rounds or number of games change, so unlike perm0() this can't fail
+// on players_mask_per_round. An exchange that compare() can't see, two
+// alike players where no pair meets or parts, is not made.
+//
+// g0 is tried from a random free game on, and g1 from a random game of
+// the same round, until there is a pair to exchange. Returns false if
+// there is none.
+bool
+perm2(Sched * s, Rand & generator)
+{
+  const vector<int> & free_games = team->free_games;
+  size_t n = free_games.size();
+  size_t first0 = generator.below(n);
+  size_t first1 = generator.below(n);
+  for (size_t i = 0; i < n; i++) {
+    Game * g0 = s->games[free_games[(first0 + i) % n]];
+    for (size_t j = 0; j < n && g0->players.size() > 0; j++) {
+      Game * g1 = s->games[free_games[(first1 + j) % n]];
+      if (g1 == g0 || g1->round != g0->round)
+        continue;
+
+      unsigned cnt = 0;
+      std::pair<Player*, Player*> pairs[players_per_game * players_per_game];
+      for (Player * p : g0->players) {
+        if (test_bit(g1->unavailable_mask, p->index))
+          continue;
+        for (Player * q : g1->players) {
+          if (q->count_as != p->count_as ||
+              test_bit(g0->unavailable_mask, q->index))
+            continue;
+          if (q->score == p->score && !!q->ledare == !!p->ledare &&
+              q->goalkeeper == p->goalkeeper &&
+              meet_gain(s, p, g0, g1, q) + meet_gain(s, q, g1, g0, p) == 0)
+            continue;
+          if (cnt < sizeof(pairs) / sizeof(pairs[0]))
+            pairs[cnt++] = std::make_pair(p, q);
+        }
+      }
+      if (cnt == 0)
+        continue;
+
+      const std::pair<Player*, Player*> & pq = pairs[generator.below(cnt)];
+      Player * p = pq.first;
+      Player * q = pq.second;
+      remove_player_from_game(g0, p);
+      remove_player_from_game(g1, q);
+      add_player_to_game(g0, q);
+      add_player_to_game(g1, p);
+      s->stats.exchanges++;
+      return true;
+    }
+  }
+
+  s->stats.failed[2]++;
+  return false;
+}
+
+// Move a player to another game of the same round that has room for
+// it. Games are tried like in perm2(). Returns false if no player can
+// move.
+bool
+perm3(Sched * s, Rand & generator)
+{
+  const vector<int> & free_games = team->free_games;
+  size_t n = free_games.size();
+  size_t first0 = generator.below(n);
+  size_t first1 = generator.below(n);
+  for (size_t i = 0; i < n; i++) {
+    Game * g0 = s->games[free_games[(first0 + i) % n]];
+    for (size_t j = 0; j < n && g0->players.size() > 0; j++) {
+      Game * g1 = s->games[free_games[(first1 + j) % n]];
+      if (g1 == g0 || g1->round != g0->round)
+        continue;
+
+      unsigned cnt = 0;
+      Player * shift[MAX_PLAYER];
+      for (Player * p : g0->players)
+        if (!test_bit(g1->unavailable_mask, p->index) &&
+            g1->count_players + abs(p->count_as) <= players_per_game)
+          shift[cnt++] = p;
+      if (cnt == 0)
+        continue;
+
+      Player * p = shift[generator.below(cnt)];
+      remove_player_from_game(g0, p);
+      add_player_to_game(g1, p);
+      s->stats.shifts++;
+      return true;
+    }
+  }
+
+  s->stats.failed[3]++;
+  return false;
+}
+
+// calls of propose_move(), and those that found no move, added to
+// Global by search_task()
+thread_local long moves_proposed = 0;
+thread_local long moves_failed = 0;
+
+// One of perm0() to perm3(), picked with the weights in move_mix.
+// Without counts perm1() is left out, and the number of games of every
+// player stays the same. If the one picked finds no move, one of the
+// others is picked, so this only fails when there is no move at all.
+bool
+propose_move(Sched * s, Rand & generator, bool counts)
+{
+  static bool (*const perms[4])(Sched *, Rand &) = {
+    perm0, perm1, perm2, perm3
+  };
+  int weights[4] = { move_mix[0], counts ? move_mix[1] : 0,
+                     move_mix[2], move_mix[3] };
+  if (weights[0] + weights[1] + weights[2] + weights[3] <= 0)
+    weights[0] = 1;
+
+  moves_proposed++;
+  for (;;) {
+    int total = weights[0] + weights[1] + weights[2] + weights[3];
+    if (total <= 0)
+      break;
+    int r = generator.below(total);
+    int i = 0;
+    while ((r -= weights[i]) >= 0)
+      i++;
+    if (perms[i](s, generator))
+      return true;
+    weights[i] = 0;
+  }
+  moves_failed++;
+  return false;
+}
+
+void
+permutate(Sched * s, Rand & generator) {
+
+  for (int i = 0; i < 100; i++) {
+    if (!propose_move(s, generator, false))
+      break;
+  }
+}
+
+/**
+ * The best schedule found by any thread, published without locks
+ *
+ * A Best is never modified once published. Global::best points to the
+ * current one and is replaced with compare-and-swap, bumping the version.
+ * Readers protect the Best they use with a hazard pointer, and replaced
+ * ones are freed only when no hazard pointer refers to them.
+ *
+ * Each thread keeps a BestCache with the stats of the last Best it saw.
+ * offer() rejects a schedule that doesn't beat the cached stats without
+ * touching shared memory. fetch() only skips the copy when the schedule
+ * it is given is an unchanged copy of the current Best (Sched::version),
+ * having seen its stats isn't enough.
+ */
+struct Best
+{
+  Sched * s;
+  uint64_t version;
+};
+
+struct BestCache
+{
+  uint64_t version; // 0 if nothing seen yet
+  Stats stats;
+};
+
+thread_local BestCache best_cache = { 0, Stats() };
+
+#define MAX_THREADS 256
+
+struct alignas(64) Hazard
+{
+  std::atomic<Best*> p;
+};
+
+Hazard hazards[MAX_THREADS];
+std::atomic<int> hazard_count(0);
+thread_local int hazard_slot = -1;
+
+/**
+ * Replaced Best of this thread, waiting for no hazard pointer to refer
+ *   to them. Whatever is left at thread exit is leaked, as other threads
+ *   may still be reading it.
+ */
+struct RetireList
+{
+  vector<Best*> list;
+  void scan();
+  ~RetireList() { scan(); }
+};
+
+thread_local RetireList retired;
+
+void
+RetireList::scan()
+{
+  int n = std::min(hazard_count.load(), MAX_THREADS);
+  vector<Best*> keep;
+  for (Best * b : list) {
+    bool used = false;
+    for (int i = 0; i < n && !used; i++)
+      used = hazards[i].p.load() == b;
+    if (used) {
+      keep.push_back(b);
+    } else {
+      free_sched(b->s);
+      delete b;
+    }
+  }
+  list.swap(keep);
+}
+
+struct Global
+{
+  std::atomic<Best*> best;
+  std::atomic<int> chars;
+  std::atomic<long> offers;        // calls to offer()
+  std::atomic<long> cache_rejects; // rejected on the cached stats alone
+  std::atomic<long> published;
+  std::atomic<long> contention;    // lost a compare-and-swap, retried
+  std::atomic<long> fetches;       // copies made by fetch()
+
+  /**
+   * Transposition table, Sched::hash of schedules already evaluated and
+   *   canonical_hash() of those taken.
+   *   Open addressing without locks, a full neighbourhood overwrites
+   *   the home slot, so it forgets but never gives a false hit.
+   */
+  enum { SEEN_SIZE = 1 << 18, SEEN_PROBES = 8 };
+  std::atomic<uint64_t> * seen_table;
+  std::atomic<long> lookups;       // calls to seen()
+  std::atomic<long> duplicates;    // of those already in the table
+
+  std::atomic<long> tabu_moves;    // moves made by Tabu searches
+  std::atomic<long> tabu_hits;     // candidates rejected as tabu
+  std::atomic<long> aspirations;   // tabu candidates taken as a new best
+
+  std::atomic<long> proposals;     // calls to propose_move()
+  std::atomic<long> failed_proposals; // of those that found no move
+
+  Global() : best(NULL), chars(0), offers(0), cache_rejects(0), published(0),
+             contention(0), fetches(0), lookups(0), duplicates(0),
+             tabu_moves(0), tabu_hits(0), aspirations(0),
+             proposals(0), failed_proposals(0) {
+    seen_table = new std::atomic<uint64_t>[SEEN_SIZE];
+    for (int i = 0; i < SEEN_SIZE; i++)
+      seen_table[i].store(0, std::memory_order_relaxed);
+  }
+  ~Global() { delete[] seen_table; }
+  Best * acquire();
+  void release();
+  void progress(const char * c);
+  bool offer(const Sched * s2);
+  Sched * fetch(Sched * s);
+  bool seen(uint64_t hash);
+  void print_counters();
+};
+
+/**
+ * Stop condition on the stats that compare() looks at, see --target.
+ * A field of -1 is not checked.
+ */
+struct Target
+{
+  int never;      // cnt_never_together <=
+  int ledare;     // min_ledare >=
+  int goalkeeper; // cnt_goalkeeper >=
+  int min_games;  // min_games >=
+  int max_games;  // max_games <=
+  int min_score;  // min_score >=
+  int energy;     // energy() <=
+};
+
+Target target = { -1, -1, -1, -1, -1, -1, -1 };
+bool target_set = false;
+
+/**
+ * Parse "never=0,ledare=2" style --target
+ */
+bool
+parse_target(const char * spec)
+{
+  static const struct { const char * name; int Target::*field; } keys[] = {
+    { "never", &Target::never },
+    { "ledare", &Target::ledare },
+    { "goalkeeper", &Target::goalkeeper },
+    { "min_games", &Target::min_games },
+    { "max_games", &Target::max_games },
+    { "min_score", &Target::min_score },
+    { "energy", &Target::energy },
+  };
+
+  std::string s = spec;
+  size_t pos = 0;
+  while (pos < s.size()) {
+    size_t end = s.find(',', pos);
+    if (end == std::string::npos)
+      end = s.size();
+    std::string item = s.substr(pos, end - pos);
+    size_t eq = item.find('=');
+    bool found = false;
+    for (const auto & key : keys) {
+      if (eq != std::string::npos && item.substr(0, eq) == key.name) {
+        target.*key.field = atoi(item.c_str() + eq + 1);
+        found = true;
+      }
+    }
+    if (!found) {
+      fprintf(stderr, "bad --target item: %s\n", item.c_str());
+      return false;
+    }
+    pos = end + 1;
+  }
+  target_set = true;
+  return true;
+}
+
+bool
+target_reached(const Sched * s)
+{
+  const Stats & st = s->stats;
+  if (!target_set)
+    return false;
+  if (target.never >= 0 && st.cnt_never_together > target.never)
+    return false;
+  if (target.ledare >= 0 && st.min_ledare < target.ledare)
+    return false;
+  if (target.goalkeeper >= 0 && st.cnt_goalkeeper < target.goalkeeper)
+    return false;
+  if (target.min_games >= 0 && st.min_games < target.min_games)
+    return false;
+  if (target.max_games >= 0 && st.max_games > target.max_games)
+    return false;
+  if (target.min_score >= 0 && st.min_score < target.min_score)
+    return false;
+  if (target.energy >= 0 && energy(s) > target.energy)
+    return false;
+  return true;
+}
+
+/**
+ * Write the best schedule of t to its output, once. Called as soon as
+ *   the target or the time budget is reached, or else at the end.
+ */
+void
+write_best(Team * t)
+{
+  if (t->written.exchange(true))
+    return;
+
+  const char * name = t->output_filename ? t->output_filename : "stdout";
+  Best * best = t->global->acquire();
+  if (best == NULL) {
+    t->global->release();
+    fprintf(stderr, "%s: no schedule\n", name);
+    return;
+  }
+  FILE * out = t->output_filename ? fopen(t->output_filename, "w") : stdout;
+  if (out == NULL) {
+    perror(t->output_filename);
+  } else {
+    print_sched(best->s, out);
+    if (out != stdout)
+      fclose(out);
+    else
+      fflush(out);
+  }
+  if (t->start)
+    fprintf(stderr, "%s: %d changes from %s\n", name,
+            sched_changes(t->start, best->s), t->start_filename);
+  t->global->release();
+}
+
+/**
+ * Load best and protect it with this thread's hazard pointer
+ */
+Best * Global::acquire()
+{
+  if (hazard_slot < 0) {
+    hazard_slot = hazard_count++;
+    if (hazard_slot >= MAX_THREADS) {
+      fprintf(stderr, "more than %d threads\n", MAX_THREADS);
+      exit(1);
+    }
+  }
+  Best * b = best.load();
+  for (;;) {
+    hazards[hazard_slot].p.store(b);
+    Best * b2 = best.load();
+    if (b2 == b)
+      return b;
+    b = b2;
+  }
+}
+
+void Global::release()
+{
+  hazards[hazard_slot].p.store(NULL, std::memory_order_release);
+}
+
+void Global::progress(const char * c)
+{
+  fputs(c, stderr);
+  if (++chars % 79 == 0)
+    fputs("\n", stderr);
+}
+
+/**
+ * Publish a copy of s2 if it is better than the best schedule
+ *
+ * Returns true if it was published, and the caller then holds
+ *   the best schedule.
+ */
+bool Global::offer(const Sched * s2)
+{
+  offers.fetch_add(1, std::memory_order_relaxed);
+  if (best_cache.version && compare(&best_cache.stats, s2, false) <= 0) {
+    cache_rejects.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  Best * node = NULL;
+  for (;;) {
+    Best * b = acquire();
+    if (b) {
+      best_cache.version = b->version;
+      best_cache.stats = b->s->stats;
+      if (compare(b->s, s2, true) <= 0) {
+        release();
+        if (node) {
+          free_sched(node->s);
+          delete node;
+        }
+        return false;
+      }
+    }
+    if (!node) {
+      node = new Best;
+      node->s = copy_sched(s2);
+    }
+    node->version = b ? b->version + 1 : 1;
+    if (best.compare_exchange_strong(b, node)) {
+      release();
+      best_cache.version = node->version;
+      best_cache.stats = s2->stats;
+      published.fetch_add(1, std::memory_order_relaxed);
+      progress("L");
+      if (target_reached(s2)) {
+        team->done = true;
+        write_best(team);
+      } else if (bounds_reached(s2->stats) && !team->done.exchange(true)) {
+        fprintf(stderr, "\nbounds reached\n");
+      }
+      if (b) {
+        retired.list.push_back(b);
+        if (retired.list.size() >= 16)
+          retired.scan();
+      }
+      return true;
+    }
+    release();
+    contention.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/**
+ * Replace s with a copy of the best schedule, unless s is an unchanged
+ *   copy of the current version
+ */
+Sched * Global::fetch(Sched * s)
+{
+  Best * b = acquire();
+  if (!b || (s && b->version == s->version)) {
+    release();
+    return s;
+  }
+  Sched * copy = copy_sched(b->s);
+  copy->version = b->version;
+  best_cache.version = b->version;
+  best_cache.stats = b->s->stats;
+  release();
+  fetches.fetch_add(1, std::memory_order_relaxed);
+  progress("#");
+  free_sched(s);
+  return copy;
+}
+
+/**
+ * Add hash (a Sched::hash or canonical_hash()) to the transposition table,
+ *   returns true if it was there
+ */
+bool Global::seen(uint64_t hash)
+{
+  lookups.fetch_add(1, std::memory_order_relaxed);
+  if (hash == 0) // marks an empty slot
+    hash = 1;
+  size_t home = (hash >> 32) & (SEEN_SIZE - 1);
+  for (int i = 0; i < SEEN_PROBES; i++) {
+    std::atomic<uint64_t> & slot = seen_table[(home + i) & (SEEN_SIZE - 1)];
+    uint64_t h = slot.load(std::memory_order_relaxed);
+    if (h == 0 && slot.compare_exchange_strong(h, hash,
+                                               std::memory_order_relaxed))
+      return false;
+    if (h == hash) {
+      duplicates.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  seen_table[home].store(hash, std::memory_order_relaxed);
+  return false;
+}
+
+void Global::print_counters()
+{
+  long n = lookups.load();
+  long dups = duplicates.load();
+  fprintf(stderr, "\noffers: %ld cache rejects: %ld published: %ld"
+          " contention: %ld fetches: %ld\n",
+          offers.load(), cache_rejects.load(), published.load(),
+          contention.load(), fetches.load());
+  fprintf(stderr, "dedup: %ld of %ld (%.1f%%)\n",
+          dups, n, n ? 100.0 * dups / n : 0.0);
+  long moves = proposals.load();
+  long failed = failed_proposals.load();
+  fprintf(stderr, "moves: %ld proposed, %ld found no move (%.2f%%)\n",
+          moves, failed, moves ? 100.0 * failed / moves : 0.0);
+  if (tabu_mode)
+    fprintf(stderr, "tabu: %ld moves %ld tabu hits %ld aspirations\n",
+            tabu_moves.load(), tabu_hits.load(), aspirations.load());
+}
+
+double
+tempering_temp(int replica)
+{
+  if (team->tempering_replicas <= 1)
+    return tempering_tmin;
+  double step = (double)replica / (team->tempering_replicas - 1);
+  return tempering_tmin * pow(tempering_tmax / tempering_tmin, step);
+}
+
+/**
+ * Deterministic mode
+ *
+ * Threads don't touch global while searching. Every epoch_loops loops they
+ * all meet in sync_epoch(), and thread 0 alone offers their candidates to
+ * global in thread order, and in tempering mode exchanges neighbouring
+ * replicas. With the same seed and thread count the result is the same.
+ */
+struct EpochSlot
+{
+  const Sched * offer; // candidate for global, or NULL
+  Sched * s;           // current schedule, exchanged in tempering mode
+  int e;
+};
+
+thread_local int thread_no = 0;
+
+static
+void
+merge_epoch()
+{
+  int n = team->tempering_replicas;
+  for (int i = 0; i < n; i++)
+    if (team->epoch_slots[i].offer)
+      team->global->offer(team->epoch_slots[i].offer);
+
+  if (tempering_mode) {
+    // even pairs on even epochs, odd pairs on odd epochs
+    for (int i = team->epoch_count % 2; i + 1 < n; i += 2) {
+      EpochSlot & lower = team->epoch_slots[i];
+      EpochSlot & upper = team->epoch_slots[i + 1];
+      double p = exp((1 / tempering_temp(i) - 1 / tempering_temp(i + 1)) *
+                     (lower.e - upper.e));
+      if (p >= 1 || thread_rand.unit() < p) {
+        std::swap(lower.s, upper.s);
+        std::swap(lower.e, upper.e);
+      }
+    }
+  }
+
+  team->epoch_count++;
+  team->epoch_stop = stopping();
+}
+
+/**
+ * Wait for all threads to finish the epoch, see EpochSlot
+ *
+ * Returns true when the threads should stop.
+ */
+bool
+sync_epoch(const Sched * offer, Sched *& s, int & e)
+{
+  EpochSlot & slot = team->epoch_slots[thread_no];
+  slot.offer = offer;
+  slot.s = s;
+  slot.e = e;
+  pthread_barrier_wait(&team->epoch_barrier);
+  if (thread_no == 0)
+    merge_epoch();
+  pthread_barrier_wait(&team->epoch_barrier);
+  s = slot.s;
+  e = slot.e;
+  return team->epoch_stop;
+}
+
+/**
+ * Time to reach a target, used by bench_search()
+ */
+struct Progress
+{
+  int target;  // stop when energy <= target
+  int energy;  // lowest energy seen
+  int loops;   // loops when target was reached
+  double ms;   // time when target was reached
+  bool reached;
+  double max_ms; // give up after this long
+  std::chrono::steady_clock::time_point start;
+  const Stats * goal; // if set, stop when as_good_as() goal instead
+};
+
+static
+bool
+check_progress(Progress * progress, const Sched * s, int loops)
+{
+  int e = energy(s);
+  if (e < progress->energy)
+    progress->energy = e;
+  double ms = std::chrono::duration<double, std::milli>
+    (std::chrono::steady_clock::now() - progress->start).count();
+  progress->loops = loops;
+  bool reached = progress->goal ? as_good_as(s->stats, *progress->goal) :
+    progress->energy <= progress->target;
+  if (!reached)
+    return ms > progress->max_ms;
+
+  progress->reached = true;
+  progress->ms = ms;
+  return true;
+}
+
+/**
+ * Schedule for a search to start or restart from: the one given
+ *   with --start, or a new create_base_sched4()
+ */
+Sched*
+start_sched(Rand & generator)
+{
+  if (team->start)
+    return copy_sched(team->start);
+  return create_base_sched4(generator);
+}
+
+/**
+ * A search that can be run a slice of loops at a time, so that it can be
+ *   a task in the Pool. It draws from thread_rand, which search_task()
+ *   points at the generator of the search.
+ */
+struct Engine
+{
+  int loops;
+  int max_loops;
+
+  Engine(int max_loops) : loops(0), max_loops(max_loops) {}
+  virtual ~Engine() {}
+  // run up to n more loops, returns false when done
+  virtual bool run(int n) = 0;
+};
+
+/**
+ * Hill climbing, accept a new schedule only if compare() says it's better.
+ *
+ * If progress is set, run without global and stop when target is reached.
+ * In deterministic mode, global is only used through sync_epoch(), and the
+ * streak and wins limits don't apply as all threads have to run as many
+ * epochs.
+ *
+ * A shared search skips candidates that are in the transposition table,
+ * see Global::seen(). One that was evaluated before was no better than
+ * the schedule it was compared with, or it has been offered already. The
+ * Zobrist Sched::hash is looked up before a candidate is evaluated, and
+ * only a candidate that wins is canonical_hash()ed, so that a permutation
+ * of one taken before (see find_symmetries()) isn't taken again.
+ *
+ * Every 2000 loops s is polish()ed, so every search sweeps the rounds of
+ * its own schedule.
+ */
+struct Climb : Engine
+{
+  Progress * progress;
+  Sched * base;
+  Sched * s;
+  Stats prev;           // stats of s before permutate()
+  uint64_t prev_version; // of s, restored with it by undo_moves()
+  vector<Move> journal; // moves done by permutate()
+  bool shared;          // offer to and fetch from global directly
+  int streak;
+  int wins;
+
+  Climb(int max_loops, Progress * progress);
+  ~Climb() { free_sched(s); free_sched(base); }
+  bool run(int n);
+};
+
+Climb::Climb(int max_loops, Progress * progress)
+  : Engine(max_loops), progress(progress)
+{
+  base = start_sched(thread_rand);
+  s = copy_sched(base);
+  compute_stats(s);
+  shared = progress == NULL && !deterministic_mode;
+  streak = 1;
+  wins = 0;
+  if (shared) {
+    team->global->seen(s->hash);
+    team->global->seen(canonical_hash(s));
+    team->global->offer(s);
+  }
+}
+
+bool
+Climb::run(int n)
+{
+  Rand & generator = thread_rand;
+  while (n-- > 0 && loops++ < max_loops) {
+    bool done = streak++ >= 500000 || wins >= 100000 || stopping();
+    if (done && !deterministic_mode)
+      return false;
+    if (polish_leaves > 0 && (loops % 2000) == 0 && polish(s, generator)) {
+      streak = 1;
+      wins = 0;
+      if (shared)
+        team->global->offer(s);
+    }
+    /**
+     * s2 == NULL means that s has been permutated in place,
+     *   and can be restored by undo_moves(journal)
+     */
+    Sched * s2 = NULL;
+    switch(streak % 4) {
+    case 0:
+    case 3:
+      prev = s->stats;
+      prev_version = s->version;
+      journal.clear();
+      s->journal = &journal;
+      if (streak % 4 == 0)
+        permutate(s, generator);
+      else
+        rebuild_rounds(s, generator);
+      s->journal = NULL;
       break;
-    default:
     case 1:
+      s2 = create_base_sched4(generator);
+      break;
+    default:
     case 2:
-    case 3:
       s2 = create_base_sched3(generator);
       break;
     case 4:
       s2 = create_base_sched();
       break;
     }
-    compute_stats(s2);
-    if ((loops % 200) == 0)
-    {
-      delete s;
-      s = global.promote(s2);
+    /**
+     * Look the candidate up before its stats are computed. If no move
+     *   was made s is unchanged and in the table already, so it isn't
+     *   hashed at all. Undoing the moves restores the stats of s.
+     */
+    if (shared && ((s2 == NULL && journal.empty()) ||
+                   team->global->seen((s2 ? s2 : s)->hash))) {
+      if (s2 != NULL) {
+        free_sched(s2);
+      } else {
+        undo_moves(s, journal);
+        s->version = prev_version;
+      }
+      if ((loops % 200) == 0)
+        s = team->global->fetch(s);
+      continue;
+    }
+    compute_stats(s2 ? s2 : s);
+    if ((loops % 200) == 0 && shared)
+    {
+      if (s2 != NULL) {
+        if (team->global->offer(s2)) {
+          free_sched(s);
+          s = s2;
+        } else {
+          free_sched(s2);
+        }
+      } else if (!team->global->offer(s)) {
+        undo_moves(s, journal);
+        s->version = prev_version;
+        compute_stats(s);
+      }
+      s = team->global->fetch(s);
+    }
+    else
+    {
+      int res = s2 ? compare(s, s2, false) :
+        compare(&prev, s, false);
+      if (res > 0 && shared &&
+          team->global->seen(canonical_hash(s2 ? s2 : s)))
+        res = 0;
+      if (res <= 0) {
+        if (res < 0)
+          wins = 0;
+        else
+          wins++;
+        if (s2 != NULL) {
+          free_sched(s2);
+        } else {
+          undo_moves(s, journal);
+          s->version = prev_version;
+          compute_stats(s);
+        }
+      } else {
+        wins = 0;
+        streak = 1;
+        if (s2 != NULL) {
+          free_sched(s);
+          s = s2;
+        }
+        if (shared)
+          team->global->offer(s);
+      }
+    }
+
+    if (deterministic_mode &&
+        ((loops % epoch_loops) == 0 || loops == max_loops)) {
+      int e = 0;
+      if (sync_epoch(s, s, e))
+        return false;
+      s = team->global->fetch(s);
+    }
+
+    if (progress && check_progress(progress, s, loops))
+      return false;
+  }
+  return loops < max_loops;
+}
+
+void
+climb(int max_loops, Progress * progress)
+{
+  Climb c(max_loops, progress);
+  while (c.run(INT_MAX))
+    ;
+}
+
+/**
+ * Make one propose_move() on s, evaluate it in place and
+ *   accept it with the Metropolis criterion at temperature t
+ */
+static
+void
+anneal_step(Sched * s, int & e, double t,
+            Rand & generator, vector<Move> & journal)
+{
+  journal.clear();
+  s->journal = &journal;
+  propose_move(s, generator, true);
+  s->journal = NULL;
+
+  if (journal.empty())
+    return;
+
+  compute_stats(s);
+  int e2 = energy(s);
+  if (e2 <= e || generator.unit() < exp((e - e2) / t)) {
+    e = e2;
+  } else {
+    undo_moves(s, journal);
+    compute_stats(s);
+  }
+}
+
+/**
+ * Simulated annealing over single propose_move() moves, using energy()
+ *
+ * The temperature starts at anneal_t0 and is multiplied by anneal_alpha
+ * every loop, down to anneal_tmin. After anneal_reheat loops without a new
+ * best schedule it is reheated to anneal_t0 and goes on from its best
+ * schedule, so the work of the earlier cooling is kept.
+ *
+ * If progress is set, run without global and stop when target is reached.
+ */
+struct Anneal : Engine
+{
+  Progress * progress;
+  Sched * s;
+  Sched * best;
+  int e;
+  int best_e;
+  double t;
+  int since_best;
+  vector<Move> journal;
+
+  Anneal(int max_loops, Progress * progress);
+  ~Anneal();
+  bool run(int n);
+};
+
+Anneal::Anneal(int max_loops, Progress * progress)
+  : Engine(max_loops), progress(progress)
+{
+  s = start_sched(thread_rand);
+  compute_stats(s);
+  best = copy_sched(s);
+  e = energy(s);
+  best_e = e;
+  t = anneal_t0;
+  since_best = 0;
+}
+
+Anneal::~Anneal()
+{
+  if (progress == NULL && !deterministic_mode)
+    team->global->offer(best);
+  free_sched(best);
+  free_sched(s);
+}
+
+bool
+Anneal::run(int n)
+{
+  Rand & generator = thread_rand;
+  while (n-- > 0 && loops++ < max_loops) {
+    if (stopping() && !deterministic_mode)
+      return false;
+
+    anneal_step(s, e, t, generator, journal);
+
+    if (e < best_e) {
+      best_e = e;
+      since_best = 0;
+      free_sched(best);
+      best = copy_sched(s);
+      if (progress == NULL && !deterministic_mode)
+        team->global->offer(s);
+    } else if (++since_best >= anneal_reheat) {
+      since_best = 0;
+      t = anneal_t0;
+      free_sched(s);
+      s = copy_sched(best);
+      e = best_e;
+    }
+
+    t *= anneal_alpha;
+    if (t < anneal_tmin)
+      t = anneal_tmin;
+
+    if (deterministic_mode &&
+        ((loops % epoch_loops) == 0 || loops == max_loops) &&
+        sync_epoch(best, s, e))
+      return false;
+
+    if (progress && check_progress(progress, s, loops))
+      return false;
+  }
+  return loops < max_loops;
+}
+
+void
+anneal(int max_loops, Progress * progress)
+{
+  Anneal a(max_loops, progress);
+  while (a.run(INT_MAX))
+    ;
+}
+
+/**
+ * Tabu search over sampled propose_move() moves
+ *
+ * Each loop tries one candidate move on s and undoes it. Every
+ * tabu_candidates loops the best of them by compare() is made, even if
+ * it makes s worse, so that the search walks off plateaus instead of
+ * going back and forth. A candidate that puts a player back in a game it
+ * left less than tabu_tenure moves ago is tabu, unless it beats the best
+ * schedule of the search (aspiration). Both that and a new best are
+ * decided by a strict compare(), without its random tie-break.
+ *
+ * After tabu_restart loops without a new best it polish()es its best and
+ * restarts from it with a rebuild_rounds() kick.
+ *
+ * If progress is set, run without global and stop when target is reached.
+ */
+struct Tabu : Engine
+{
+  Progress * progress;
+  Sched * s;
+  Sched * best;
+  vector<int> until;     // [game index * players + player index], tabu
+                         // while moves < until
+  int moves;
+  int tried;             // moves tried since the last move made
+  bool have_chosen;
+  Stats chosen_stats;
+  vector<Move> chosen;   // best candidate since the last move
+  vector<Move> journal;
+  int since_best;
+  long hits;
+  long aspirations;
+
+  Tabu(int max_loops, Progress * progress);
+  ~Tabu();
+  bool run(int n);
+  bool is_tabu() const;
+  bool try_candidate(Rand & generator);
+  void make_move();
+  void restart(Rand & generator);
+};
+
+Tabu::Tabu(int max_loops, Progress * progress)
+  : Engine(max_loops), progress(progress)
+{
+  s = start_sched(thread_rand);
+  compute_stats(s);
+  best = copy_sched(s);
+  until.assign(s->games.size() * team->players.size(), 0);
+  moves = 0;
+  tried = 0;
+  have_chosen = false;
+  since_best = 0;
+  hits = 0;
+  aspirations = 0;
+}
+
+Tabu::~Tabu()
+{
+  if (progress == NULL) {
+    Global * global = team->global;
+    global->tabu_moves.fetch_add(moves, std::memory_order_relaxed);
+    global->tabu_hits.fetch_add(hits, std::memory_order_relaxed);
+    global->aspirations.fetch_add(aspirations, std::memory_order_relaxed);
+    if (!deterministic_mode)
+      global->offer(best);
+  }
+  free_sched(best);
+  free_sched(s);
+}
+
+/**
+ * True if journal puts a player back in a game it left recently
+ */
+bool
+Tabu::is_tabu() const
+{
+  size_t n = team->players.size();
+  for (const Move & m : journal)
+    if (m.add && moves < until[m.g->index * n + m.p->index])
+      return true;
+  return false;
+}
+
+/**
+ * Try a move on s and undo it, keep it in chosen if it is the best
+ *   one allowed so far. Returns false if there was no move to make.
+ */
+bool
+Tabu::try_candidate(Rand & generator)
+{
+  journal.clear();
+  s->journal = &journal;
+  propose_move(s, generator, true);
+  s->journal = NULL;
+
+  if (journal.empty())
+    return false;
+
+  compute_stats(s);
+  bool ok = true;
+  if (is_tabu()) {
+    ok = compare(best, s, false, true) > 0;
+    if (ok)
+      aspirations++;
+    else
+      hits++;
+  }
+  ok = ok && (!have_chosen || compare(&chosen_stats, s, false) > 0);
+  if (ok)
+    chosen_stats = s->stats;
+  undo_moves(s, journal);
+  if (ok) {
+    have_chosen = true;
+    chosen.swap(journal);
+  }
+  return true;
+}
+
+/**
+ * Make the chosen candidate move, and make leaving its games tabu
+ */
+void
+Tabu::make_move()
+{
+  tried = 0;
+  if (!have_chosen) {
+    compute_stats(s);
+    return;
+  }
+  have_chosen = false;
+  redo_moves(s, chosen);
+  compute_stats(s);
+  moves++;
+  size_t n = team->players.size();
+  for (const Move & m : chosen)
+    if (!m.add)
+      until[m.g->index * n + m.p->index] = moves + tabu_tenure;
+
+  if (compare(best, s, false, true) > 0) {
+    since_best = 0;
+    free_sched(best);
+    best = copy_sched(s);
+    if (progress == NULL && !deterministic_mode)
+      team->global->offer(s);
+  }
+}
+
+void
+Tabu::restart(Rand & generator)
+{
+  if (polish_leaves > 0 && polish(best, generator) &&
+      progress == NULL && !deterministic_mode)
+    team->global->offer(best);
+  since_best = 0;
+  tried = 0;
+  have_chosen = false;
+  free_sched(s);
+  s = copy_sched(best);
+  rebuild_rounds(s, generator);
+  compute_stats(s);
+  std::fill(until.begin(), until.end(), 0);
+}
+
+bool
+Tabu::run(int n)
+{
+  Rand & generator = thread_rand;
+  while (n-- > 0 && loops++ < max_loops) {
+    if (stopping() && !deterministic_mode)
+      return false;
+
+    if (try_candidate(generator) && ++tried >= tabu_candidates)
+      make_move();
+    if (++since_best >= tabu_restart)
+      restart(generator);
+
+    if (deterministic_mode &&
+        ((loops % epoch_loops) == 0 || loops == max_loops)) {
+      int e = 0;
+      if (sync_epoch(best, s, e))
+        return false;
+    }
+
+    if (progress && check_progress(progress, best, loops))
+      return false;
+  }
+  return loops < max_loops;
+}
+
+void
+tabu(int max_loops, Progress * progress)
+{
+  Tabu t(max_loops, progress);
+  while (t.run(INT_MAX))
+    ;
+}
+
+/**
+ * Parallel tempering (replica exchange)
+ *
+ * Search i runs Temper at a fixed temperature tempering_temp(i), from
+ * coldest to hottest. Every tempering_interval loops neighbours i and i+1
+ * exchange schedules through exchanges[i], without locks:
+ *
+ * - i (colder) posts a copy of its schedule and goes on (EMPTY => OFFERED)
+ * - i+1 decides with the Metropolis criterion, and if accepted takes the
+ *   posted schedule and leaves a copy of its own (OFFERED => ANSWERED)
+ * - i picks up the answer at its next exchange (ANSWERED => EMPTY)
+ *
+ * In deterministic mode exchanges are instead done by merge_epoch(),
+ * every epoch_loops loops.
+ */
+struct alignas(64) Exchange
+{
+  enum { EMPTY = 0, OFFERED = 1, ANSWERED = 2 };
+  std::atomic<int> state;
+  Sched * offer;
+  int offer_e;
+  Sched * reply; // NULL if exchange was rejected
+
+  Exchange() : state(EMPTY), offer(NULL), offer_e(0), reply(NULL) {}
+};
+
+struct Temper : Engine
+{
+  int replica;
+  double t;
+  bool hottest;
+  Exchange * lower;
+  Exchange * upper;
+  Sched * s;
+  int e;
+  int best_e;
+  int since_best;
+  Sched * best; // offered at the next epoch in deterministic mode
+  vector<Move> journal;
+
+  Temper(int replica, int max_loops);
+  ~Temper() { free_sched(best); free_sched(s); }
+  bool run(int n);
+};
+
+Temper::Temper(int replica, int max_loops)
+  : Engine(max_loops), replica(replica)
+{
+  t = tempering_temp(replica);
+  hottest = replica == team->tempering_replicas - 1;
+  lower = replica > 0 ? &team->exchanges[replica - 1] : NULL;
+  upper = hottest ? NULL : &team->exchanges[replica];
+
+  s = start_sched(thread_rand);
+  compute_stats(s);
+  e = energy(s);
+  best_e = e;
+  since_best = 0;
+  best = NULL;
+}
+
+bool
+Temper::run(int n)
+{
+  Rand & generator = thread_rand;
+  while (n-- > 0 && loops++ < max_loops) {
+    if (stopping() && !deterministic_mode)
+      return false;
+
+    anneal_step(s, e, t, generator, journal);
+
+    if (e < best_e) {
+      best_e = e;
+      since_best = 0;
+      if (deterministic_mode) {
+        free_sched(best);
+        best = copy_sched(s);
+      } else {
+        team->global->offer(s);
+      }
+    } else if (++since_best >= anneal_reheat && hottest) {
+      // the hottest replica feeds new material into the ladder
+      since_best = 0;
+      free_sched(s);
+      s = start_sched(generator);
+      compute_stats(s);
+      e = energy(s);
+    }
+
+    if (deterministic_mode) {
+      if ((loops % epoch_loops) != 0 && loops != max_loops)
+        continue;
+      bool stop = sync_epoch(best, s, e);
+      free_sched(best);
+      best = NULL;
+      if (stop)
+        return false;
+      continue;
+    }
+
+    if ((loops % tempering_interval) != 0)
+      continue;
+
+    if (upper) {
+      int state = upper->state.load(std::memory_order_acquire);
+      if (state == Exchange::ANSWERED) {
+        if (upper->reply) {
+          free_sched(s);
+          s = upper->reply;
+          e = energy(s);
+        }
+        upper->state.store(Exchange::EMPTY, std::memory_order_release);
+      } else if (state == Exchange::EMPTY) {
+        upper->offer = copy_sched(s);
+        upper->offer_e = e;
+        upper->state.store(Exchange::OFFERED, std::memory_order_release);
+      }
+    }
+
+    if (lower &&
+        lower->state.load(std::memory_order_acquire) == Exchange::OFFERED) {
+      double t_lower = tempering_temp(replica - 1);
+      double p = exp((1 / t_lower - 1 / t) * (lower->offer_e - e));
+      if (p >= 1 || generator.unit() < p) {
+        lower->reply = s;
+        s = lower->offer;
+        e = lower->offer_e;
+      } else {
+        lower->reply = NULL;
+        free_sched(lower->offer);
+      }
+      lower->offer = NULL;
+      lower->state.store(Exchange::ANSWERED, std::memory_order_release);
+    }
+  }
+  return loops < max_loops;
+}
+
+/**
+ * Exact search, see --exact
+ *
+ * Depth first over the free games in round order, each filled with
+ * players in index order, and a round is complete when no one else fits
+ * in it, so every schedule it builds is one that create_base_sched3()
+ * could. A complete schedule is
+ * ranked by ExactKey, and a game is only closed if the ExactKey bound()
+ * of what can follow beats the best schedule so far.
+ *
+ * Interchangeable players (find_symmetries()) that have played the same
+ * games so far are only taken in index order, and so are the first
+ * players of interchangeable games of a round.
+ *
+ * Runs as search 0, the other searches go on as usual. Their schedules
+ * from global tighten the bound, and if the search completes its best is
+ * the best by ExactKey among maximal-round schedules, those with complete
+ * rounds. A schedule with an under-filled game can still beat it, so the
+ * other searches are not stopped, and it is offered like any other one.
+ */
+const int EXACT_KEYS = 8;
+
+/**
+ * The criteria of compare() in the same order, higher is better,
+ *   compared lexicographically without compare()'s tolerances
+ */
+struct ExactKey
+{
+  int v[EXACT_KEYS];
+
+  bool operator<(const ExactKey & o) const {
+    return std::lexicographical_compare(v, v + EXACT_KEYS,
+                                        o.v, o.v + EXACT_KEYS);
+  }
+};
+
+static
+ExactKey
+exact_key(const Stats & st)
+{
+  int gpp = team->games_per_player;
+  ExactKey k = { {
+      st.min_games >= gpp,
+      st.max_games < gpp + cmp_games_diff,
+      st.min_ledare >= cmp_min_ledare,
+      st.cnt_goalkeeper,
+      st.min_score,
+      st.median_score,
+      -st.cnt_never_together,
+      st.max_score,
+    } };
+  return k;
+}
+
+static
+void
+print_key(const char * what, const ExactKey & k)
+{
+  fprintf(stderr, "%s:", what);
+  for (int i = 0; i < EXACT_KEYS; i++)
+    fprintf(stderr, " %d", k.v[i]);
+  fprintf(stderr, "\n");
+}
+
+struct Exact : Engine
+{
+  struct Frame
+  {
+    int pos;    // game order[pos]
+    int cursor; // next player to try adding
+    int added;  // player added when the frame was pushed, or -1
+    bool closed;
+  };
+
+  Sched * s;
+  Sched * best;
+  ExactKey best_key;
+  uint64_t seen_version;     // of global best, see adopt()
+  vector<Game*> order;       // free games by round
+  vector<int> pos_of;        // [game index] position in order, -1 if frozen
+  vector<uint64_t> history;  // [player index] hash of the games played
+  vector<Frame> stack;
+  long nodes;
+  long leaves;
+  long pruned;
+
+  Exact();
+  ~Exact() { free_sched(s); free_sched(best); }
+  bool run(int n);
+
+  void adopt(const Sched * s2);
+  bool eligible(int pos, int p, bool symmetry) const;
+  bool closable(int pos) const;
+  ExactKey bound(int pos, int cursor) const;
+  void leaf();
+  void report(bool complete);
+};
+
+Exact::Exact() : Engine(INT_MAX)
+{
+  s = copy_sched(team->empty_sched);
+  compute_stats(s);
+  best = NULL;
+  seen_version = 0;
+  nodes = 0;
+  leaves = 0;
+  pruned = 0;
+
+  order = free_games_by_round(s);
+  pos_of.assign(s->games.size(), -1);
+  for (size_t i = 0; i < order.size(); i++)
+    pos_of[order[i]->index] = i;
+
+  // the frozen games are already played
+  history.assign(team->players.size(), 0);
+  for (const Game * g : s->games)
+    for (const Player * p : g->players)
+      history[p->index] += mix64(g->index + 1);
+
+  if (team->start)
+    adopt(team->start);
+  for (int i = 0; i < 100; i++) {
+    Sched * s2 = i % 2 ? create_base_sched3(thread_rand) :
+      create_base_sched4(thread_rand);
+    adopt(s2);
+    free_sched(s2);
+  }
+
+  Frame f = { 0, 0, -1, false };
+  stack.push_back(f);
+}
+
+/**
+ * Take s2 as the best schedule if it beats it
+ */
+void
+Exact::adopt(const Sched * s2)
+{
+  ExactKey k = exact_key(s2->stats);
+  if (best && !(best_key < k))
+    return;
+  free_sched(best);
+  best = copy_sched(s2);
+  best_key = k;
+}
+
+/**
+ * Can player p be added to game order[pos]
+ */
+bool
+Exact::eligible(int pos, int p, bool symmetry) const
+{
+  const Game * g = order[pos];
+  if (!can_play(s, g, team->players[p]))
+    return false;
+  if (!symmetry)
+    return true;
+
+  const vector<int> & player_class = team->player_class;
+  const vector<int> & game_class = team->game_class;
+  if (g->players.size() == 0) {
+    for (int i = pos - 1; i >= 0 && order[i]->round == g->round; i--) {
+      const Game * g2 = order[i];
+      if (game_class[g2->index] == game_class[g->index] &&
+          g2->players.size() > 0 && g2->players[0]->index > p)
+        return false;
+    }
+  }
+  for (int q = 0; q < p; q++) {
+    if (player_class[q] == player_class[p] && history[q] == history[p] &&
+        !test_bit(s->players_mask_per_round[g->round], q))
+      return false;
+  }
+  return true;
+}
+
+/**
+ * A round is complete when no one else fits in any of its games, as in
+ *   create_base_sched3(), so order[pos] can always be closed unless it is
+ *   the last game of its round
+ */
+bool
+Exact::closable(int pos) const
+{
+  int round = order[pos]->round;
+  if (pos + 1 < (int)order.size() && order[pos + 1]->round == round)
+    return true;
+  for (int i = pos; i >= 0 && order[i]->round == round; i--)
+    for (size_t p = 0; p < team->players.size(); p++)
+      if (eligible(i, p, false))
+        return false;
+  return true;
+}
+
+/**
+ * Upper bound on the ExactKey of any schedule that completes s, where
+ *   the games before order[pos] are done and order[pos] can still get
+ *   players from index cursor on
+ */
+ExactKey
+Exact::bound(int pos, int cursor) const
+{
+  return exact_key(sched_bounds(s, order, pos, cursor));
+}
+
+void
+Exact::leaf()
+{
+  leaves++;
+  compute_stats(s);
+  ExactKey k = exact_key(s->stats);
+  if (best_key < k) {
+    adopt(s);
+    team->global->offer(s);
+  }
+}
+
+void
+Exact::report(bool complete)
+{
+  fprintf(stderr, "\nexact: %s after %ld nodes, %ld leaves, %ld pruned\n",
+          complete ? "best among maximal-round schedules" :
+          "stopped, not proven", nodes, leaves, pruned);
+  print_key("exact key", best_key);
+  if (complete)
+    team->global->offer(best);
+}
+
+bool
+Exact::run(int n)
+{
+  // schedules found by the other searches tighten the bound
+  Best * b = team->global->acquire();
+  if (b && b->version != seen_version) {
+    seen_version = b->version;
+    adopt(b->s);
+  }
+  team->global->release();
+
+  const vector<Player*> & players = team->players;
+  int count = players.size();
+  while (n-- > 0) {
+    if (stopping()) {
+      report(false);
+      return false;
+    }
+    if (stack.empty()) {
+      report(true);
+      return false;
     }
-    else
-    {
-      int res = compare(s, s2, false);
-      if (res < 0) {
-        wins = 0;
-        delete s2;
-      } else if (res == 0) {
-        wins++;
-        delete s2;
+    nodes++;
+
+    Frame & f = stack.back();
+    Game * g = order[f.pos];
+    while (f.cursor < count && !eligible(f.pos, f.cursor, true))
+      f.cursor++;
+    if (f.cursor < count) {
+      int p = f.cursor++;
+      add_player_to_game(g, players[p]);
+      history[p] += mix64(g->index + 1);
+      Frame next = { f.pos, p + 1, p, false };
+      // the frame is pushed even if pruned, to undo the add
+      if (!(best_key < bound(f.pos, p + 1))) {
+        next.cursor = count;
+        next.closed = true;
+        pruned++;
+      }
+      stack.push_back(next);
+      continue;
+    }
+
+    if (!f.closed) {
+      f.closed = true;
+      if (!closable(f.pos))
+        continue;
+      if (f.pos + 1 == (int)order.size()) {
+        leaf();
+      } else if (best_key < bound(f.pos + 1, 0)) {
+        Frame next = { f.pos + 1, 0, -1, false };
+        stack.push_back(next);
       } else {
-        wins = 0;
-        streak = 1;
-        delete s;
-        s = global.promote(s2);
+        pruned++;
+      }
+      continue;
+    }
+
+    if (f.added >= 0) {
+      remove_player_from_game(g, players[f.added]);
+      history[f.added] -= mix64(g->index + 1);
+    }
+    stack.pop_back();
+  }
+  return true;
+}
+
+/**
+ * Work stealing task pool
+ *
+ * Each worker has a deque of tasks. It runs tasks from the back of its own
+ * deque, and when that is empty steals from the front of the others.
+ * Tasks pushed by a worker go to its own deque, others round robin.
+ */
+struct Task
+{
+  void (*run)(void * arg);
+  void * arg;
+};
+
+struct Worker
+{
+  std::mutex mutex;
+  std::deque<Task> tasks;
+  pthread_t thread;
+  long runs;
+  long steals;
+
+  Worker() : runs(0), steals(0) {}
+};
+
+thread_local int worker_no = -1;
+
+struct Pool
+{
+  vector<Worker*> workers;
+  std::atomic<int> pending;  // pushed and not yet finished
+  std::atomic<unsigned> next;
+  std::atomic<bool> quit;
+  std::mutex idle_mutex;
+  std::condition_variable idle;
+  bool pin;                  // pin worker i to cpu i
+
+  Pool() : pending(0), next(0), quit(false), pin(false) {}
+  void start(int n);
+  void push(void (*run)(void * arg), void * arg, bool yield = false);
+  bool take(int w, Task & task);
+  bool wait_for(int ms);
+  void stop();
+} pool;
+
+static
+void *
+worker_main(void * arg)
+{
+  worker_no = (long long)arg;
+  Worker * self = pool.workers[worker_no];
+  if (pool.pin) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker_no % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      fprintf(stderr, "worker %d: can't set cpu affinity\n", worker_no);
+  }
+
+  while (!pool.quit) {
+    Task task;
+    if (!pool.take(worker_no, task)) {
+      std::unique_lock<std::mutex> lock(pool.idle_mutex);
+      pool.idle.wait_for(lock, std::chrono::milliseconds(1));
+      continue;
+    }
+    task.run(task.arg);
+    self->runs++;
+    if (--pool.pending == 0)
+      pool.idle.notify_all();
+  }
+  return NULL;
+}
+
+void Pool::start(int n)
+{
+  for (int i = 0; i < n; i++)
+    workers.push_back(new Worker);
+  for (int i = 0; i < n; i++)
+    pthread_create(&workers[i]->thread, NULL, worker_main, (void*)(long long)i);
+}
+
+/**
+ * Add a task. With yield it goes behind the others of the worker, for a
+ *   task that continues itself, so that the others get to run too.
+ */
+void Pool::push(void (*run)(void * arg), void * arg, bool yield)
+{
+  Task task = { run, arg };
+  pending++;
+  int w = worker_no >= 0 ? worker_no : next++ % workers.size();
+  {
+    std::lock_guard<std::mutex> lock(workers[w]->mutex);
+    if (yield)
+      workers[w]->tasks.push_front(task);
+    else
+      workers[w]->tasks.push_back(task);
+  }
+  idle.notify_one();
+}
+
+bool Pool::take(int w, Task & task)
+{
+  {
+    Worker * self = workers[w];
+    std::lock_guard<std::mutex> lock(self->mutex);
+    if (!self->tasks.empty()) {
+      task = self->tasks.back();
+      self->tasks.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); i++) {
+    Worker * victim = workers[(w + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.front();
+      victim->tasks.pop_front();
+      workers[w]->steals++;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Wait up to ms for all tasks, including those they push
+ *
+ * Returns true when there are no tasks left.
+ */
+bool Pool::wait_for(int ms)
+{
+  std::unique_lock<std::mutex> lock(idle_mutex);
+  if (pending > 0)
+    idle.wait_for(lock, std::chrono::milliseconds(ms));
+  return pending == 0;
+}
+
+/**
+ * Stop the workers, call when wait_for() has returned true
+ */
+void Pool::stop()
+{
+  quit = true;
+  idle.notify_all();
+  long runs = 0;
+  long steals = 0;
+  for (Worker * w : workers) {
+    pthread_join(w->thread, NULL);
+    runs += w->runs;
+    steals += w->steals;
+    delete w;
+  }
+  workers.clear();
+  fprintf(stderr, "\ntasks: %ld steals: %ld\n", runs, steals);
+}
+
+/**
+ * Search number no, run slice_loops loops at a time as a pool task
+ *
+ * The search has its own generator and BestCache, swapped into the thread
+ * locals while it runs, so that it doesn't matter which worker runs it.
+ */
+const int slice_loops = 1000;
+
+struct SearchTask
+{
+  Team * team;
+  int no;
+  Rand rand;
+  BestCache cache;
+  Engine * engine;
+};
+
+void
+search_task(void * arg)
+{
+  SearchTask * t = (SearchTask*)arg;
+  std::swap(thread_rand, t->rand);
+  std::swap(best_cache, t->cache);
+  team = t->team;
+  thread_no = t->no;
+
+  if (t->engine == NULL) {
+    if (exact_mode && t->no == 0)
+      t->engine = new Exact();
+    else if (tempering_mode)
+      t->engine = new Temper(t->no, search_loops);
+    else if (anneal_mode)
+      t->engine = new Anneal(search_loops, NULL);
+    else if (tabu_mode)
+      t->engine = new Tabu(search_loops, NULL);
+    else
+      t->engine = new Climb(search_loops, NULL);
+  }
+  bool more = t->engine->run(slice_loops);
+  team->global->proposals.fetch_add(moves_proposed,
+                                    std::memory_order_relaxed);
+  team->global->failed_proposals.fetch_add(moves_failed,
+                                           std::memory_order_relaxed);
+  moves_proposed = 0;
+  moves_failed = 0;
+  if (!more) {
+    delete t->engine;
+    t->engine = NULL;
+  }
+
+  std::swap(thread_rand, t->rand);
+  std::swap(best_cache, t->cache);
+  if (more)
+    pool.push(search_task, t, true);
+}
+
+/**
+ * Make the games of rounds before free_round in t->start part of
+ *   empty_sched, so that every schedule starts with them. Nobody else is
+ *   available for those games, so constructors and moves leave them alone.
+ */
+void
+freeze_rounds(Team * t, int free_round)
+{
+  t->free_round = free_round;
+  // bits above the players would make count_available() negative
+  mask_t all = 0;
+  for (const Player * p : t->players)
+    set_bit(all, p->index);
+  int frozen = 0;
+  for (size_t i = 0; i < t->start->games.size(); i++) {
+    Game * from = t->start->games[i];
+    Game * g = t->empty_sched->games[i];
+    if (g->round >= free_round)
+      continue;
+    for (Player * p : from->players)
+      add_player_to_game(g, p);
+    g->unavailable_mask = ~g->players_mask;
+    g->unavailable_mask &= all;
+    from->unavailable_mask = g->unavailable_mask;
+    frozen += from->players.size();
+  }
+  compute_stats(t->empty_sched);
+  if (free_round > 0)
+    fprintf(stderr, "rounds before %d frozen, %d players in games\n",
+            free_round, frozen);
+}
+
+/**
+ * Read the files of t and make it the current team
+ */
+void
+load_team(Team * t)
+{
+  team = t;
+  read_games(t->games_filename);
+  read_players(t->players_filename);
+  create_empty_sched();
+  find_symmetries(t);
+  t->global = new Global;
+  if (t->start_filename) {
+    t->start = read_sched(t->start_filename);
+    if (t->start == NULL)
+      exit(1);
+    freeze_rounds(t, freeze_round);
+    t->global->offer(t->start);
+  } else if (freeze_round > 0) {
+    fprintf(stderr, "--freeze needs --start\n");
+    exit(1);
+  }
+  for (Game * g : t->empty_sched->games)
+    if (g->round >= t->free_round)
+      t->free_games.push_back(g->index);
+  if (t->free_games.empty()) {
+    fprintf(stderr, "no rounds left after --freeze=%d\n", freeze_round);
+    exit(1);
+  }
+  compute_bounds(t);
+}
+
+/**
+ * Teams for --batch, one per line of the manifest, either
+ *   a directory: read matcher.csv and spelare.csv, write schema.csv in it
+ *   or three files: games players output
+ *   or four: games players output start, see --start
+ */
+vector<Team*>
+read_manifest(const char * filename)
+{
+  vector<Team*> teams;
+  FILE * f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    exit(1);
+  }
+  char * buf = NULL;
+  size_t sz = 0;
+  while (getline(&buf, &sz, f) > 0)
+  {
+    if (buf[0] == '#')
+      continue;
+
+    char * field[4];
+    int n = 0;
+    for (char * tok = strtok(buf, " \t\n"); tok && n < 4;
+         tok = strtok(NULL, " \t\n"))
+      field[n++] = tok;
+    if (n == 0)
+      continue;
+
+    Team * t = new Team();
+    if (n >= 3) {
+      t->games_filename = strdup(field[0]);
+      t->players_filename = strdup(field[1]);
+      t->output_filename = strdup(field[2]);
+      if (n == 4)
+        t->start_filename = strdup(field[3]);
+    } else {
+      std::string dir = field[0];
+      t->games_filename = strdup((dir + "/matcher.csv").c_str());
+      t->players_filename = strdup((dir + "/spelare.csv").c_str());
+      t->output_filename = strdup((dir + "/schema.csv").c_str());
+    }
+    for (const char * name : { t->games_filename, t->players_filename }) {
+      if (access(name, R_OK) != 0) {
+        perror(name);
+        exit(1);
       }
     }
+    teams.push_back(t);
+  }
+  free(buf);
+  fclose(f);
+  return teams;
+}
+
+/**
+ * Set up the shared search state of t for searches searches,
+ *   and push them to the pool
+ */
+void
+start_team(Team * t, int searches, SearchTask * tasks)
+{
+  t->tempering_replicas = searches;
+  void * ptr = NULL;
+  if (posix_memalign(&ptr, 64, searches * sizeof(Exchange)) != 0) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  t->exchanges = (Exchange*)ptr;
+  for (int i = 0; i < searches; i++)
+    new (&t->exchanges[i]) Exchange();
+  t->epoch_slots.resize(searches);
+  pthread_barrier_init(&t->epoch_barrier, NULL, searches);
+
+  for (int i = 0; i < searches; i++) {
+    SearchTask & task = tasks[i];
+    task.team = t;
+    task.no = i;
+    task.rand.seed(rand_seed + i);
+    task.cache.version = 0;
+    task.engine = NULL;
+    pool.push(search_task, &task);
+  }
+}
+
+/**
+ * Write the best schedule found for t
+ */
+void
+finish_team(Team * t)
+{
+  team = t;
+  for (int i = 0; i < t->tempering_replicas; i++) {
+    Exchange & ex = t->exchanges[i];
+    free_sched(ex.offer);
+    if (ex.state == Exchange::ANSWERED)
+      free_sched(ex.reply);
+  }
+  free(t->exchanges);
+  const char * name = t->output_filename ? t->output_filename : "stdout";
+  fprintf(stderr, "%s (%d searches):", name, t->tempering_replicas);
+  t->global->print_counters();
+  write_best(t);
+}
+
+/**
+ * Time to target of another search against hill climbing.
+ *
+ * First hill climb runs times for max_ms each, the median of those by
+ *   final energy is the target. With by_stats the target is its stats,
+ *   reached when as_good_as() them, else its energy. Then measure the
+ *   loops and time each method needs to reach that target, using the
+ *   same seeds. A loop is one candidate schedule for both.
+ */
+int
+bench_search(const char * name, void (*search)(int, Progress *),
+             bool by_stats, int runs, double max_ms)
+{
+  int loops = INT_MAX;
+  vector<std::pair<int, Stats> > finals;
+  for (int r = 0; r < runs; r++) {
+    thread_rand.seed(r + 1);
+    Progress progress = { INT_MIN, INT_MAX, 0, 0, false, max_ms,
+                          std::chrono::steady_clock::now(), NULL };
+    Climb c(loops, &progress);
+    while (c.run(INT_MAX))
+      ;
+    finals.push_back(std::make_pair(progress.energy, c.s->stats));
+  }
+  std::sort(finals.begin(), finals.end(),
+            [](const std::pair<int, Stats> & a,
+               const std::pair<int, Stats> & b) {
+              return a.first < b.first;
+            });
+  int target = finals[finals.size() / 2].first;
+  const Stats goal = finals[finals.size() / 2].second;
+  if (by_stats)
+    fprintf(stderr, "target stats: min_games: %d max_games: %d ledare: %d"
+            " goalkeeper: %d min_score: %d median_score: %d never: %d"
+            " (median of %d climbs, %.0f ms)\n",
+            goal.min_games, goal.max_games, goal.min_ledare,
+            goal.cnt_goalkeeper, goal.min_score, goal.median_score,
+            goal.cnt_never_together, runs, max_ms);
+  else
+    fprintf(stderr, "target energy: %d (median of %d climbs, %.0f ms)\n",
+            target, runs, max_ms);
+
+  const char * names[2] = { "climb", name };
+  vector<double> ms[2];
+  vector<int> reached_loops[2];
+  for (int r = 0; r < runs; r++) {
+    for (int m = 0; m < 2; m++) {
+      thread_rand.seed(r + 1);
+      Progress progress = { target, INT_MAX, 0, 0, false, max_ms,
+                            std::chrono::steady_clock::now(),
+                            by_stats ? &goal : NULL };
+      if (m == 0)
+        climb(loops, &progress);
+      else
+        search(loops, &progress);
+      fprintf(stderr, "seed %d %-6s: %s loops: %7d ms: %8.1f energy: %d\n",
+              r + 1, names[m],
+              progress.reached ? "reached" : "MISSED ",
+              progress.loops,
+              progress.reached ? progress.ms : -1.0,
+              progress.energy);
+      ms[m].push_back(progress.reached ? progress.ms : 2 * max_ms);
+      reached_loops[m].push_back(progress.reached ? progress.loops : INT_MAX);
+    }
+  }
+
+  for (int m = 0; m < 2; m++) {
+    std::sort(ms[m].begin(), ms[m].end());
+    std::sort(reached_loops[m].begin(), reached_loops[m].end());
+    double median = ms[m][ms[m].size() / 2];
+    if (median > max_ms)
+      fprintf(stderr, "%-6s median time to target: not reached\n",
+              names[m]);
+    else
+      fprintf(stderr, "%-6s median time to target: %.1f ms loops: %d\n",
+              names[m], median, reached_loops[m][runs / 2]);
+  }
+  return 0;
+}
+
+/**
+ * Microbenchmark of the bit kernels against the loops
+ *   that count_bits() and rand_bit() used to be
+ */
+static
+int
+count_bits_loop(const mask_t & mask) {
+  int count = 0;
+  for (int i = 0; i < MAX_PLAYER; i++)
+    if (test_bit(mask, i))
+      count++;
+  return count;
+}
+
+static
+unsigned
+rand_bit_loop(const mask_t & mask)
+{
+  unsigned cnt = 0;
+  unsigned list[MAX_PLAYER] = { 0 };
+  for (unsigned i = 0; i < MAX_PLAYER; i++)
+    if (test_bit(mask, i))
+      list[cnt++] = i;
+  assert(cnt > 0);
+  return list[rand() % cnt];
+}
+
+template <typename F>
+double
+bench_ns(const vector<mask_t> & masks, int loops, F f)
+{
+  unsigned sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int l = 0; l < loops; l++)
+    for (const mask_t & m : masks)
+      sum += f(m);
+  auto stop = std::chrono::steady_clock::now();
+  // keep sum, and so the calls, from being optimized away
+  __asm__ __volatile__("" : : "r"(sum));
+  double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+  return ns / (loops * (double)masks.size());
+}
+
+int
+bench_bits()
+{
+  const int loops = 2000;
+  Rand r;
+  r.seed(1);
+  vector<mask_t> masks(1024);
+  for (mask_t & m : masks) {
+    m = 0;
+    // 8 out of the first 20 players (a squad), and a few more
+    for (int i = 0; i < 8; i++)
+      set_bit(m, r.below(20));
+    for (int i = 0; i < 8; i++)
+      set_bit(m, r.below(MAX_PLAYER));
   }
+
+  fprintf(stderr, "MAX_PLAYER: %d, ns per call\n", MAX_PLAYER);
+  fprintf(stderr, "count_bits loop     : %6.2f\n",
+          bench_ns(masks, loops, count_bits_loop));
+  fprintf(stderr, "count_bits portable : %6.2f\n",
+          bench_ns(masks, loops, count_bits_portable));
+#if HAVE_BIT_KERNELS_X86
+  if (__builtin_cpu_supports("popcnt"))
+    fprintf(stderr, "count_bits popcnt   : %6.2f\n",
+            bench_ns(masks, loops, count_bits_popcnt));
+#endif
+
+  fprintf(stderr, "rand_bit loop+rand(): %6.2f\n",
+          bench_ns(masks, loops, rand_bit_loop));
+  fprintf(stderr, "rand_bit portable   : %6.2f\n",
+          bench_ns(masks, loops, [&r](const mask_t & m) {
+              return select_bit_portable(m, r.below(count_bits_portable(m)));
+            }));
+#if HAVE_BIT_KERNELS_X86
+  if (__builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi2"))
+    fprintf(stderr, "rand_bit bmi2       : %6.2f\n",
+            bench_ns(masks, loops, [&r](const mask_t & m) {
+                return select_bit_bmi2(m, r.below(count_bits_popcnt(m)));
+              }));
+#endif
+  fprintf(stderr, "rand_bit (in use)   : %6.2f\n",
+          bench_ns(masks, loops, rand_bit));
+  return 0;
 }
 
 int
 main(int argc, char** argv)
 {
-  srand(time(0));
-  read_games(games_filename);
-  read_players(players_filename);
-  create_empty_sched();
+  static struct option long_options[] = {
+    { "bench-bits", no_argument, 0, 'B' },
+    { "bench-anneal", optional_argument, 0, 'A' },
+    { "anneal", no_argument, 0, 'a' },
+    { "anneal-t0", required_argument, 0, 'T' },
+    { "anneal-alpha", required_argument, 0, 'C' },
+    { "anneal-tmin", required_argument, 0, 'M' },
+    { "anneal-reheat", required_argument, 0, 'R' },
+    { "bench-tabu", optional_argument, 0, 'K' },
+    { "tabu", no_argument, 0, 'U' },
+    { "tabu-tenure", required_argument, 0, 'u' },
+    { "tabu-candidates", required_argument, 0, 'k' },
+    { "tabu-restart", required_argument, 0, 'r' },
+    { "tempering", no_argument, 0, 'P' },
+    { "tempering-tmin", required_argument, 0, 'm' },
+    { "tempering-tmax", required_argument, 0, 'x' },
+    { "tempering-interval", required_argument, 0, 'i' },
+    { "seed", required_argument, 0, 's' },
+    { "threads", required_argument, 0, 'N' },
+    { "workers", required_argument, 0, 'w' },
+    { "pin", no_argument, 0, 'p' },
+    { "batch", required_argument, 0, 'b' },
+    { "start", required_argument, 0, 'S' },
+    { "loops", required_argument, 0, 'l' },
+    { "freeze", required_argument, 0, 'F' },
+    { "time-budget", required_argument, 0, 'G' },
+    { "target", required_argument, 0, 'g' },
+    { "exact", no_argument, 0, 'X' },
+    { "polish", required_argument, 0, 'o' },
+    { "move-mix", required_argument, 0, 'v' },
+    { "deterministic", no_argument, 0, 'D' },
+    { "epoch", required_argument, 0, 'E' },
+    { 0, 0, 0, 0 }
+  };
+
+  bool bench = false;
+  int threads = -1;
+  int workers = -1;
+  const char * manifest = NULL;
+  const char * start_filename = NULL;
+  rand_seed = time(0);
+  int bench_runs = 0;
+  bool bench_tabu = false;
+  double time_budget = 0;
+  bool loops_set = false;
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'B':
+      bench = true;
+      break;
+    case 'A':
+      bench_runs = optarg ? atoi(optarg) : 5;
+      break;
+    case 'a':
+      anneal_mode = true;
+      break;
+    case 'T':
+      anneal_t0 = atof(optarg);
+      break;
+    case 'C':
+      anneal_alpha = atof(optarg);
+      break;
+    case 'M':
+      anneal_tmin = atof(optarg);
+      break;
+    case 'R':
+      anneal_reheat = atoi(optarg);
+      break;
+    case 'K':
+      bench_runs = optarg ? atoi(optarg) : 5;
+      bench_tabu = true;
+      break;
+    case 'U':
+      tabu_mode = true;
+      break;
+    case 'u':
+      tabu_tenure = atoi(optarg);
+      break;
+    case 'k':
+      tabu_candidates = std::max(atoi(optarg), 1);
+      break;
+    case 'r':
+      tabu_restart = atoi(optarg);
+      break;
+    case 'P':
+      tempering_mode = true;
+      break;
+    case 'm':
+      tempering_tmin = atof(optarg);
+      break;
+    case 'x':
+      tempering_tmax = atof(optarg);
+      break;
+    case 'i':
+      tempering_interval = atoi(optarg);
+      break;
+    case 's':
+      rand_seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'N':
+      threads = atoi(optarg);
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    case 'p':
+      pool.pin = true;
+      break;
+    case 'b':
+      manifest = optarg;
+      break;
+    case 'S':
+      start_filename = optarg;
+      break;
+    case 'l':
+      search_loops = atoi(optarg);
+      loops_set = true;
+      break;
+    case 'F':
+      freeze_round = atoi(optarg);
+      break;
+    case 'G':
+      time_budget = atof(optarg);
+      break;
+    case 'g':
+      if (!parse_target(optarg))
+        return 1;
+      break;
+    case 'X':
+      exact_mode = true;
+      break;
+    case 'o':
+      polish_leaves = atol(optarg);
+      break;
+    case 'v':
+      if (sscanf(optarg, "%d,%d,%d,%d", &move_mix[0], &move_mix[1],
+                 &move_mix[2], &move_mix[3]) != 4) {
+        fprintf(stderr, "bad --move-mix: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'D':
+      deterministic_mode = true;
+      break;
+    case 'E':
+      epoch_loops = std::max(atoi(optarg), 1);
+      break;
+    default:
+      fprintf(stderr,
+              "usage: %s [--bench-bits] [--bench-anneal[=runs]]\n"
+              "  [--anneal] [--anneal-t0=T] [--anneal-alpha=A]"
+              " [--anneal-tmin=T] [--anneal-reheat=loops]\n"
+              "  [--bench-tabu[=runs]] [--tabu] [--tabu-tenure=moves]"
+              " [--tabu-candidates=N] [--tabu-restart=loops]\n"
+              "  [--tempering] [--tempering-tmin=T] [--tempering-tmax=T]"
+              " [--tempering-interval=loops]\n"
+              "  [--seed=N] [--threads=N] [--deterministic] [--epoch=loops]\n"
+              "  [--workers=N] [--pin] [--batch=manifest]\n"
+              "  [--start=schedule.csv] [--loops=N] [--freeze=round]\n"
+              "  [--time-budget=seconds]"
+              " [--target=never=N,ledare=N,goalkeeper=N,min_games=N,"
+              "max_games=N,min_score=N,energy=N] [--exact]\n"
+              "  [--polish=splits] [--move-mix=perm0,perm1,exchange,shift]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  if (exact_mode && deterministic_mode) {
+    fprintf(stderr, "--exact can't be combined with --deterministic\n");
+    return 1;
+  }
+
+  init_bit_kernels();
+  if (bench)
+    return bench_bits();
+
+  fprintf(stderr, "seed: %llu\n", (unsigned long long)rand_seed);
+  vector<Team*> teams;
+  if (manifest) {
+    teams = read_manifest(manifest);
+  } else {
+    Team * t = new Team();
+    t->games_filename = games_filename;
+    t->players_filename = players_filename;
+    t->start_filename = start_filename;
+    teams.push_back(t);
+  }
+  auto t0 = std::chrono::steady_clock::now();
+  for (Team * t : teams)
+    load_team(t);
+  // with a time budget the searches run until it is spent
+  if (time_budget > 0 && !loops_set)
+    search_loops = INT_MAX;
   signal(SIGINT, sigterm);
   signal(SIGTERM, sigterm);
 
-  int threads = sysconf(_SC_NPROCESSORS_ONLN);
-  if (threads > 0)
-    threads--;
-  if (threads <= 1)
-    thread_main(0);
-  else
-  {
-    vector<pthread_t> rep;
-    for (int i = 0; i < threads; i++)
-    {
-      pthread_t thread;
-      pthread_create(&thread, NULL, thread_main, (void*)(long long)i);
-      rep.push_back(thread);
-    }
-    for (int i = 0; i < threads; i++)
-    {
-      void *val;
-      pthread_join(rep[i], &val);
+  if (bench_runs > 0 && bench_tabu)
+    return bench_search("tabu", tabu, true, bench_runs, 5000);
+  if (bench_runs > 0)
+    return bench_search("anneal", anneal, false, bench_runs, 5000);
+
+  // threads is the number of searches, workers the threads running them
+  int cpus = std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+  if (workers <= 0)
+    workers = cpus;
+  if (threads <= 0)
+    threads = workers;
+
+  // share the searches between teams by games x players
+  double difficulty = 0;
+  for (Team * t : teams)
+    difficulty += t->file_games.size() * t->players.size();
+  vector<int> searches;
+  int total = 0;
+  for (Team * t : teams) {
+    double share = t->file_games.size() * t->players.size() / difficulty;
+    searches.push_back(std::max(1, (int)(threads * share + 0.5)));
+    total += searches.back();
+  }
+
+  // searches wait for each other at the epoch barrier
+  if (deterministic_mode)
+    workers = std::max(workers, total);
+
+  vector<SearchTask> tasks(total);
+  pool.start(workers);
+  int first = 0;
+  for (size_t i = 0; i < teams.size(); i++) {
+    start_team(teams[i], searches[i], &tasks[first]);
+    first += searches[i];
+  }
+  bool spent = false;
+  while (!pool.wait_for(10)) {
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - t0;
+    if (time_budget > 0 && elapsed.count() >= time_budget && !spent) {
+      // write first, the searches stop at their next slice
+      spent = true;
+      for (Team * t : teams) {
+        t->done = true;
+        team = t;
+        write_best(t);
+      }
+      fprintf(stderr, "\ntime budget spent: %.2fs\n", elapsed.count());
     }
   }
-  print_sched(global.s);
+  pool.stop();
+  for (Team * t : teams)
+    finish_team(t);
 
   return 0;
 }
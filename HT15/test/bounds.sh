@@ -0,0 +1,17 @@
+#!/bin/sh
+#
+# Early stop: the players of test/bounds split into two games of even
+# strength, which reaches the bounds of sched_bounds(), so the search
+# has to stop with "bounds reached" long before --loops runs out
+#
+# usage: test/bounds.sh path/to/schema
+
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cd "$(dirname "$0")/bounds" || exit 1
+if "$bin" --threads=2 --loops=1000000 2>&1 >/dev/null |
+    grep -q "bounds reached"; then
+  echo "bounds: ok"
+else
+  echo "bounds: FAILED, bounds not reached"
+  exit 1
+fi
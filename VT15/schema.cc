@@ -3,6 +3,9 @@
 #include <string.h>
 #include <assert.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
 
 #include <vector>
 #include <algorithm>
@@ -45,6 +48,65 @@ clear_bit(mask_t & mask, int bit) {
   mask &= ~(mask_t)(1 << bit);
 }
 
+// seeds the generator, --seed
+uint64_t rand_seed = 0;
+
+struct Rand
+{
+  uint64_t s[4];
+
+  Rand() { seed(0); }
+
+  void seed(uint64_t seed) {
+    // splitmix64 to spread seed over the state
+    for (int i = 0; i < 4; i++) {
+      uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      s[i] = z ^ (z >> 31);
+    }
+  }
+
+  static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+  }
+
+  // UniformRandomBitGenerator, for the <random> distributions
+  typedef uint64_t result_type;
+  static constexpr uint64_t min() { return 0; }
+  static constexpr uint64_t max() { return UINT64_MAX; }
+  uint64_t operator()() { return next(); }
+
+  uint64_t next() {
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+  }
+
+  // uniform in [0, n) without modulo bias (Lemire's method)
+  uint32_t below(uint32_t n) {
+    uint64_t m = (next() >> 32) * n;
+    uint32_t low = (uint32_t)m;
+    if (low < n) {
+      uint32_t threshold = -n % n;
+      while (low < threshold) {
+        m = (next() >> 32) * n;
+        low = (uint32_t)m;
+      }
+    }
+    return m >> 32;
+  }
+};
+
+// Every random choice is made from it, seeded once in main()
+Rand generator;
+
 static inline
 unsigned
 rand_bit(mask_t mask)
@@ -55,7 +117,7 @@ rand_bit(mask_t mask)
     if (test_bit(mask, i))
       list[cnt++] = i;
   assert(cnt > 0);
-  return list[rand() % cnt];
+  return list[generator.below(cnt)];
 }
 
 struct Matrix
@@ -788,7 +850,7 @@ sort_by_score_rand(const Player * p1, const Player * p2)
 void rand_players(vector<Player*> & players)
 {
   for (Player * p : players) {
-    p->rand_no = rand();
+    p->rand_no = generator.below(INT_MAX);
   }
   std::sort(players.begin(), players.end(), sort_by_score_rand);
 }
@@ -912,7 +974,7 @@ create_base_sched2()
     if (games.empty())
       continue;
 
-    Game * g = games[rand() % games.size()];
+    Game * g = games[generator.below(games.size())];
     remove_player_from_game(s, g, p);
   }
 
@@ -1024,7 +1086,7 @@ perm0(Sched * s)
     }
   }
 
-  size_t g0n = rand() % s->games.size();
+  size_t g0n = generator.below(s->games.size());
   Game * g0 = 0;
   for (size_t i = 0; i < s->games.size(); i++) {
     Game * g = s->games[(g0n + i) % s->games.size()];
@@ -1036,7 +1098,7 @@ perm0(Sched * s)
 
   Player * p1 = players[rand_bit(candidates)];
   Game * g1 = 0;
-  size_t g1n = rand() % s->games.size();
+  size_t g1n = generator.below(s->games.size());
   for (size_t i = 0; i < s->games.size(); i++) {
     Game * g = s->games[(g1n + i) % s->games.size()];
     if (test_bit(g->players_mask, p1->index)) {
@@ -1080,14 +1142,13 @@ perm0(Sched * s)
 
   int found = 0;
   Player * p2[MAX_PLAYER] = { 0 };
-  std::default_random_engine generator;
   std::normal_distribution<double> distribution(0, 50);
 
   do {
     int dist = distribution(generator);
     if (dist < 0)
       continue;
-    size_t pos = rand() % cnt;
+    size_t pos = generator.below(cnt);
     for (size_t n = 0; n < cnt; n++) {
       size_t i = (n + pos) % cnt;
       Player * p = swap[i];
@@ -1147,7 +1208,26 @@ permutate(Sched * s) {
 int
 main(int argc, char** argv)
 {
-  srand(time(0));
+  static struct option long_options[] = {
+    { "seed", required_argument, 0, 's' },
+    { 0, 0, 0, 0 }
+  };
+
+  rand_seed = time(0);
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (c) {
+    case 's':
+      rand_seed = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [--seed=N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  fprintf(stderr, "seed: %llu\n", (unsigned long long)rand_seed);
+  generator.seed(rand_seed);
   read_games(games_filename);
   read_players(players_filename);
   create_empty_sched();